@@ -0,0 +1,70 @@
+// Throughput of the transfer encoders for each instruction set.
+// The scalar encoder is the one used before, like libcurl's.
+#include <chrono>
+#include <iostream>
+
+#include "libcurlwrappersmtp.hpp"
+
+using namespace libcurlwrappersmtp;
+
+static const char* isa_name(isa set) {
+  switch (set) {
+    case isa::avx2:
+      return ("avx2");
+    case isa::ssse3:
+      return ("ssse3");
+    default:
+      return ("scalar");
+  }
+}
+
+template <class Encode>
+static double gbps(const std::string& input, Encode encode) {
+  std::string out_;
+  size_t bytes_ = 0;
+  auto start_ = std::chrono::steady_clock::now();
+  auto elapsed_ = std::chrono::duration<double>(0);
+  while (elapsed_.count() < 1.0) {
+    out_.clear();
+    encode(input, out_);
+    bytes_ += input.size();
+    elapsed_ = std::chrono::steady_clock::now() - start_;
+  }
+  return (bytes_ / elapsed_.count() / 1e9);
+}
+
+int main() {
+  constexpr size_t size_ = 8 * 1024 * 1024;
+  std::mt19937_64 random64_(42);
+  // An attachment
+  std::string binary_(size_, '\0');
+  for (auto& c : binary_) c = static_cast<char>(random64_());
+  // Lines of ASCII text with some UTF-8
+  const std::string words_[] = {"message ", "the ", "delivery ", "about ",
+                                "information ", "r\xc3\xa9sum\xc3\xa9 "};
+  std::string text_;
+  size_t line_ = 0;
+  while (text_.size() < size_) {
+    const auto& word_ = words_[random64_() % 32 == 0 ? 5 : random64_() % 5];
+    text_.append(word_);
+    line_ += word_.size();
+    if (line_ > 70) {
+      text_.append("\r\n");
+      line_ = 0;
+    }
+  }
+
+  std::cout << "best: " << isa_name(best_isa()) << "\n";
+  for (isa set : {isa::scalar, isa::ssse3, isa::avx2}) {
+    if (set > best_isa()) break;
+    double base64_ = gbps(binary_, [set](const std::string& in, std::string& out) {
+      base64_encode(in.data(), in.size(), out, set);
+    });
+    double qp_ = gbps(text_, [set](const std::string& in, std::string& out) {
+      quoted_printable_encode(in.data(), in.size(), out, set);
+    });
+    std::cout << isa_name(set) << ": base64 " << base64_
+              << " GB/s, quoted-printable " << qp_ << " GB/s\n";
+  }
+  return (EXIT_SUCCESS);
+}
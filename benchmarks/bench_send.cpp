@@ -0,0 +1,186 @@
+// End-to-end throughput and latency against local sinks, without network.
+// Producer threads send to the sinks round robin; latency is from submit
+// to the callback.
+//   bench_send [--producers 4] [--servers 2] [--messages 20000]
+//              [--size 2000] [--batch 100] [--workers 2] [--pool 4]
+//              [--delay ms] [--fail-every n] [--sync]
+// Exits with failure if an email wasn't sent, so it can run in CI.
+#include <unistd.h>
+
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+
+#include "libcurlwrappersmtp.hpp"
+#include "smtp_sink.hpp"
+
+using namespace libcurlwrappersmtp;
+
+namespace {
+
+struct Config {
+  size_t producers{4};
+  size_t servers{2};
+  size_t messages{20000};
+  size_t size{2000};
+  size_t batch{100};
+  size_t workers{2};
+  size_t pool{4};
+  size_t delay{0};
+  size_t fail_every{0};
+  bool sync{false};
+};
+
+LatencyHistogram latency_{};
+std::atomic<size_t> done_{0};
+std::atomic<size_t> errors_{0};
+
+void callback(Request& req) {
+  auto* submitted_ =
+      static_cast<const std::chrono::steady_clock::time_point*>(req.user_data);
+  latency_.record(std::chrono::steady_clock::now() - *submitted_);
+  if (!req.error.empty() && errors_++ == 0)
+    std::cerr << "Error: " << req.error << std::endl;
+  done_++;
+}
+
+void produce(const Config& cfg, const std::vector<std::string>& urls,
+             const std::string& body, size_t id,
+             std::vector<std::chrono::steady_clock::time_point>& submitted) {
+  LibCurlWrapperEmail emailer_{};
+  std::vector<Message> batch_{};
+  for (size_t i = id; i < cfg.messages; i += cfg.producers) {
+    std::string to_ = "<rcpt" + std::to_string(i) + "@example.org>";
+    submitted[i] = std::chrono::steady_clock::now();
+    if (cfg.sync) {
+      emailer_ << server(urls[i % urls.size()].c_str())
+               << user("bench", "bench")
+               << from("Bench", "<bench@example.org>")
+               << to("Rcpt", to_.c_str()) << subject("Benchmark")
+               << mimetext(body, borrow) << userdata(&submitted[i])
+               << &callback << directive::syncperform;
+      continue;
+    }
+    Message msg_{};
+    msg_ << server(urls[i % urls.size()].c_str()) << user("bench", "bench")
+         << from("Bench", "<bench@example.org>") << to("Rcpt", to_.c_str())
+         << subject("Benchmark") << mimetext(body, borrow)
+         << userdata(&submitted[i]) << &callback;
+    batch_.push_back(std::move(msg_));
+    if (batch_.size() >= cfg.batch) emailer_.submit(std::move(batch_));
+  }
+  if (!batch_.empty()) emailer_.submit(std::move(batch_));
+}
+
+double ms(std::chrono::nanoseconds d) {
+  return (std::chrono::duration<double, std::milli>(d).count());
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  Config cfg_{};
+  const std::pair<const char*, size_t Config::*> options_[] = {
+      {"--producers", &Config::producers}, {"--servers", &Config::servers},
+      {"--messages", &Config::messages},   {"--size", &Config::size},
+      {"--batch", &Config::batch},         {"--workers", &Config::workers},
+      {"--pool", &Config::pool},           {"--delay", &Config::delay},
+      {"--fail-every", &Config::fail_every}};
+  for (int i = 1; i < argc; ++i) {
+    std::string arg_ = argv[i];
+    if (arg_ == "--sync") {
+      cfg_.sync = true;
+      continue;
+    }
+    bool known_ = false;
+    for (const auto& opt : options_) {
+      if (arg_ != opt.first || i + 1 >= argc) continue;
+      cfg_.*opt.second = strtoul(argv[++i], nullptr, 10);
+      known_ = true;
+    }
+    if (!known_) {
+      std::cerr << "Unknown option " << arg_ << std::endl;
+      return (EXIT_FAILURE);
+    }
+  }
+  cfg_.producers = std::max<size_t>(cfg_.producers, 1);
+  cfg_.servers = std::max<size_t>(cfg_.servers, 1);
+  cfg_.batch = std::max<size_t>(cfg_.batch, 1);
+
+  std::vector<std::unique_ptr<smtp_sink::SmtpSink>> sinks_{};
+  std::vector<std::string> urls_{};
+  smtp_sink::SmtpSink::Options sink_options_{};
+  sink_options_.delay = std::chrono::milliseconds(cfg_.delay);
+  sink_options_.fail_every = cfg_.fail_every;
+  for (size_t i = 0; i < cfg_.servers; ++i) {
+    sinks_.emplace_back(new smtp_sink::SmtpSink(sink_options_));
+    urls_.push_back("smtp://localhost:" +
+                    std::to_string(sinks_.back()->port()));
+  }
+  // The sinks' certificates are the CAs of this run
+  char ca_file_[] = "/tmp/bench_send_ca_XXXXXX";
+  int ca_fd_ = mkstemp(ca_file_);
+  if (ca_fd_ < 0) {
+    std::cerr << "Can't create " << ca_file_ << std::endl;
+    return (EXIT_FAILURE);
+  }
+  close(ca_fd_);
+  {
+    std::ofstream ca_(ca_file_);
+    for (const auto& sink : sinks_) ca_ << sink->certificate();
+  }
+  LibCurlWrapperEmail::set_ca_file(ca_file_);
+  LibCurlWrapperEmail::set_workers(cfg_.workers);
+  LibCurlWrapperEmail::set_pool_size(cfg_.pool);
+  // Injected failures are retried until they succeed, practically
+  if (cfg_.fail_every != 0)
+    LibCurlWrapperEmail::set_retry(10, std::chrono::milliseconds(10),
+                                   std::chrono::milliseconds(100));
+
+  std::string body_{};
+  while (body_.size() < cfg_.size)
+    body_.append("The quick brown fox jumps over the lazy dog.\r\n");
+  body_.resize(cfg_.size);
+  std::vector<std::chrono::steady_clock::time_point> submitted_(cfg_.messages);
+
+  auto start_ = std::chrono::steady_clock::now();
+  {
+    LibCurlWrapperEmail emailer_{};  // Keeps the workers for all producers
+    std::vector<std::thread> producers_{};
+    for (size_t p = 0; p < cfg_.producers; ++p)
+      producers_.emplace_back(produce, std::cref(cfg_), std::cref(urls_),
+                              std::cref(body_), p, std::ref(submitted_));
+    for (auto& t : producers_) t.join();
+    while (done_ < cfg_.messages)
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  std::chrono::duration<double> elapsed_ =
+      std::chrono::steady_clock::now() - start_;
+  unlink(ca_file_);
+
+  size_t new_ = 0;
+  size_t reused_ = 0;
+  size_t transfers_ = 0;
+  for (const auto& m : LibCurlWrapperEmail::metrics_snapshot().servers) {
+    new_ += m.new_connections;
+    reused_ += m.reused_connections;
+    transfers_ += m.transfers;
+  }
+  size_t received_ = 0;
+  for (const auto& sink : sinks_) received_ += sink->stats().messages;
+  std::cout << (cfg_.sync ? "sync" : "async") << ": " << cfg_.messages
+            << " emails of " << cfg_.size << " bytes, " << cfg_.producers
+            << " producers, " << cfg_.servers << " servers\n"
+            << "throughput " << cfg_.messages / elapsed_.count()
+            << " emails/s\n"
+            << "latency p50 " << ms(latency_.percentile(50)) << " ms, p99 "
+            << ms(latency_.percentile(99)) << " ms, p99.9 "
+            << ms(latency_.percentile(99.9)) << " ms\n"
+            << "transfers " << transfers_ << ", received " << received_
+            << ", new connections " << new_ << ", reused " << reused_ << " ("
+            << (new_ + reused_ == 0 ? 0.0
+                                    : 100.0 * reused_ / (new_ + reused_))
+            << "%)\n"
+            << "errors " << errors_ << std::endl;
+  return (errors_ == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -0,0 +1,75 @@
+// Local SMTP server which drops every message, for load tests without a
+// real relay. Runs until SIGINT or SIGTERM, then prints its counters.
+//   smtp_sink [--port 2525] [--delay ms] [--delay-at mail|data]
+//             [--fail-every n] [--fail-code 451] [--max-connections n]
+//             [--no-starttls] [--tls] [--cert-out file]
+#include <csignal>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+
+#include "smtp_sink.hpp"
+
+int main(int argc, char** argv) {
+  smtp_sink::SmtpSink::Options options_{};
+  options_.port = 2525;
+  std::string cert_out_{};
+  for (int i = 1; i < argc; ++i) {
+    std::string arg_ = argv[i];
+    const char* value_ = i + 1 < argc ? argv[i + 1] : "";
+    if (arg_ == "--no-starttls") {
+      options_.starttls = false;
+      continue;
+    }
+    if (arg_ == "--tls") {
+      options_.implicit_tls = true;
+      continue;
+    }
+    if (i + 1 >= argc) {
+      std::cerr << "Missing value of " << arg_ << std::endl;
+      return (EXIT_FAILURE);
+    }
+    ++i;
+    if (arg_ == "--port") {
+      options_.port = static_cast<uint16_t>(atoi(value_));
+    } else if (arg_ == "--delay") {
+      options_.delay = std::chrono::milliseconds(atol(value_));
+    } else if (arg_ == "--delay-at") {
+      options_.delay_at_mail = std::string(value_) == "mail";
+    } else if (arg_ == "--fail-every") {
+      options_.fail_every = strtoul(value_, nullptr, 10);
+    } else if (arg_ == "--fail-code") {
+      options_.fail_code = atoi(value_);
+    } else if (arg_ == "--max-connections") {
+      options_.max_connections = strtoul(value_, nullptr, 10);
+    } else if (arg_ == "--cert-out") {
+      cert_out_ = value_;
+    } else {
+      std::cerr << "Unknown option " << arg_ << std::endl;
+      return (EXIT_FAILURE);
+    }
+  }
+  sigset_t signals_;
+  sigemptyset(&signals_);
+  sigaddset(&signals_, SIGINT);
+  sigaddset(&signals_, SIGTERM);
+  // Threads of the sink inherit the mask, so sigwait() gets the signals
+  pthread_sigmask(SIG_BLOCK, &signals_, nullptr);
+  try {
+    smtp_sink::SmtpSink sink_(options_);
+    // Clients trust the sink with set_ca_file() or --cacert
+    if (!cert_out_.empty()) std::ofstream(cert_out_) << sink_.certificate();
+    std::cout << "Listening on 127.0.0.1:" << sink_.port() << std::endl;
+    int signal_ = 0;
+    sigwait(&signals_, &signal_);
+    auto stats_ = sink_.stats();
+    std::cout << "connections " << stats_.connections << ", refused "
+              << stats_.refused << ", messages " << stats_.messages
+              << ", failed " << stats_.failed << ", bytes " << stats_.bytes
+              << std::endl;
+  } catch (const std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    return (EXIT_FAILURE);
+  }
+  return (EXIT_SUCCESS);
+}
@@ -0,0 +1,364 @@
+// Local SMTP server for benchmarks, which accepts and drops every message.
+// It offers STARTTLS with a self-signed certificate made at startup, or
+// implicit TLS, and can delay or hold its replies, fail every nth message and
+// refuse connections over a limit. One thread for each connection.
+#pragma once
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <list>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+
+namespace smtp_sink {
+
+class SmtpSink {
+ public:
+  struct Options {
+    uint16_t port{0};  // 0 picks a free port
+    // Wait before the reply to DATA, or to MAIL with delay_at_mail
+    std::chrono::milliseconds delay{0};
+    bool delay_at_mail{false};
+    // Every nth message is refused with fail_code, 0 is never
+    size_t fail_every{0};
+    int fail_code{451};
+    // Connections over the limit get 421, 0 is unlimited
+    size_t max_connections{0};
+    bool starttls{true};
+    // TLS from the start, for smtps:// URLs
+    bool implicit_tls{false};
+  };
+  struct Stats {
+    size_t connections{0};
+    size_t refused{0};  // Over max_connections
+    size_t messages{0};
+    size_t failed{0};  // Refused with fail_code
+    size_t bytes{0};
+  };
+
+  // Listens on 127.0.0.1. Throws std::runtime_error.
+  explicit SmtpSink(const Options& options) : _options(options) {
+    _make_tls();
+    _listen = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int one_ = 1;
+    setsockopt(_listen, SOL_SOCKET, SO_REUSEADDR, &one_, sizeof(one_));
+    sockaddr_in addr_{};
+    addr_.sin_family = AF_INET;
+    addr_.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr_.sin_port = htons(options.port);
+    socklen_t len_ = sizeof(addr_);
+    if (_listen < 0 ||
+        bind(_listen, reinterpret_cast<sockaddr*>(&addr_), sizeof(addr_)) !=
+            0 ||
+        listen(_listen, 1024) != 0 ||
+        getsockname(_listen, reinterpret_cast<sockaddr*>(&addr_), &len_) != 0) {
+      if (_listen >= 0) close(_listen);
+      SSL_CTX_free(_ctx);
+      throw std::runtime_error("Can't listen on port " +
+                               std::to_string(options.port));
+    }
+    _port = ntohs(addr_.sin_port);
+    _acceptor = std::thread(&SmtpSink::_accept, this);
+  }
+  SmtpSink(const SmtpSink&) = delete;
+  SmtpSink& operator=(const SmtpSink&) = delete;
+  // Closes all connections
+  ~SmtpSink() {
+    _stopping = true;
+    release();
+    shutdown(_listen, SHUT_RDWR);
+    _acceptor.join();
+    close(_listen);
+    {
+      std::lock_guard<std::mutex> lck_(_mtx);
+      for (auto& c : _connections) shutdown(c.fd, SHUT_RDWR);
+    }
+    for (auto& c : _connections) c.thread.join();
+    SSL_CTX_free(_ctx);
+  }
+  uint16_t port() const noexcept { return (_port); }
+  // The self-signed certificate, for the clients' CA file
+  const std::string& certificate() const noexcept { return (_cert_pem); }
+  Stats stats() const noexcept {
+    return (Stats{_nConnections, _nRefused, _nMessages, _nFailed, _nBytes});
+  }
+  // Replies which are delayed wait until release(), after the delay
+  void hold() {
+    std::lock_guard<std::mutex> lck_(_hold_mtx);
+    _held = true;
+  }
+  void release() {
+    std::lock_guard<std::mutex> lck_(_hold_mtx);
+    _held = false;
+    _hold_cv.notify_all();
+  }
+
+ private:
+  // A client connection, with TLS after STARTTLS
+  class Session {
+   public:
+    Session(int fd, SSL_CTX* ctx) : _fd(fd), _ctx(ctx) {}
+    ~Session() {
+      if (_ssl != nullptr) {
+        SSL_shutdown(_ssl);
+        SSL_free(_ssl);
+      }
+    }
+    bool start_tls() {
+      _ssl = SSL_new(_ctx);
+      SSL_set_fd(_ssl, _fd);
+      _begin = _end = 0;
+      return (SSL_accept(_ssl) == 1);
+    }
+    bool tls() const noexcept { return (_ssl != nullptr); }
+    bool write(std::string_view data) {
+      while (!data.empty()) {
+        ssize_t n_ = _ssl != nullptr
+                         ? SSL_write(_ssl, data.data(),
+                                     static_cast<int>(data.size()))
+                         : send(_fd, data.data(), data.size(), MSG_NOSIGNAL);
+        if (n_ <= 0) return (false);
+        data.remove_prefix(static_cast<size_t>(n_));
+      }
+      return (true);
+    }
+    // A line without CRLF. False when the client is gone.
+    bool read_line(std::string& line) {
+      line.clear();
+      while (true) {
+        auto* begin_ = _buffer + _begin;
+        auto* lf_ = static_cast<char*>(memchr(begin_, '\n', _end - _begin));
+        if (lf_ != nullptr) {
+          size_t size_ = static_cast<size_t>(lf_ - begin_);
+          line.append(begin_, size_);
+          if (!line.empty() && line.back() == '\r') line.pop_back();
+          _begin += size_ + 1;
+          return (true);
+        }
+        line.append(begin_, _end - _begin);
+        _begin = _end = 0;
+        ssize_t n_ = _ssl != nullptr
+                         ? SSL_read(_ssl, _buffer, sizeof(_buffer))
+                         : recv(_fd, _buffer, sizeof(_buffer), 0);
+        if (n_ <= 0) return (false);
+        _end = static_cast<size_t>(n_);
+      }
+    }
+
+   private:
+    int _fd;
+    SSL_CTX* _ctx;
+    SSL* _ssl{nullptr};
+    char _buffer[16384];
+    size_t _begin{0};
+    size_t _end{0};
+  };
+  struct Connection {
+    int fd{-1};
+    std::thread thread{};
+    std::atomic<bool> done{false};
+  };
+
+  // A P-256 key and a certificate for localhost and 127.0.0.1
+  void _make_tls() {
+    EVP_PKEY* key_ = EVP_PKEY_Q_keygen(nullptr, nullptr, "EC", "P-256");
+    X509* cert_ = X509_new();
+    bool ok_ = key_ != nullptr && cert_ != nullptr;
+    if (ok_) {
+      X509_set_version(cert_, 2);
+      ASN1_INTEGER_set(X509_get_serialNumber(cert_), 1);
+      X509_gmtime_adj(X509_getm_notBefore(cert_), -3600);
+      X509_gmtime_adj(X509_getm_notAfter(cert_), 30L * 24 * 3600);
+      X509_set_pubkey(cert_, key_);
+      X509_NAME* name_ = X509_get_subject_name(cert_);
+      X509_NAME_add_entry_by_txt(
+          name_, "CN", MBSTRING_ASC,
+          reinterpret_cast<const unsigned char*>("localhost"), -1, -1, 0);
+      X509_set_issuer_name(cert_, name_);
+      X509V3_CTX v3_{};
+      X509V3_set_ctx(&v3_, cert_, cert_, nullptr, nullptr, 0);
+      const std::pair<int, const char*> exts_[] = {
+          {NID_basic_constraints, "critical,CA:TRUE"},
+          {NID_subject_alt_name, "DNS:localhost,IP:127.0.0.1"}};
+      for (const auto& ext : exts_) {
+        X509_EXTENSION* ex_ =
+            X509V3_EXT_conf_nid(nullptr, &v3_, ext.first, ext.second);
+        ok_ = ok_ && ex_ != nullptr && X509_add_ext(cert_, ex_, -1) == 1;
+        X509_EXTENSION_free(ex_);
+      }
+      ok_ = ok_ && X509_sign(cert_, key_, EVP_sha256()) != 0;
+    }
+    _ctx = SSL_CTX_new(TLS_server_method());
+    ok_ = ok_ && _ctx != nullptr && SSL_CTX_use_certificate(_ctx, cert_) == 1 &&
+          SSL_CTX_use_PrivateKey(_ctx, key_) == 1;
+    if (ok_) {
+      BIO* bio_ = BIO_new(BIO_s_mem());
+      PEM_write_bio_X509(bio_, cert_);
+      char* data_ = nullptr;
+      long size_ = BIO_get_mem_data(bio_, &data_);
+      _cert_pem.assign(data_, static_cast<size_t>(size_));
+      BIO_free(bio_);
+    }
+    X509_free(cert_);
+    EVP_PKEY_free(key_);
+    if (!ok_) {
+      SSL_CTX_free(_ctx);
+      throw std::runtime_error("Can't make a test certificate");
+    }
+  }
+  void _accept() {
+    while (!_stopping) {
+      int fd_ = accept4(_listen, nullptr, nullptr, SOCK_CLOEXEC);
+      if (fd_ < 0) {
+        if (_stopping) break;
+        continue;
+      }
+      int one_ = 1;
+      setsockopt(fd_, IPPROTO_TCP, TCP_NODELAY, &one_, sizeof(one_));
+      std::lock_guard<std::mutex> lck_(_mtx);
+      // Join finished sessions
+      for (auto it_ = _connections.begin(); it_ != _connections.end();) {
+        if (!it_->done) {
+          ++it_;
+          continue;
+        }
+        it_->thread.join();
+        it_ = _connections.erase(it_);
+      }
+      if (_options.max_connections != 0 &&
+          _connections.size() >= _options.max_connections) {
+        _nRefused++;
+        static constexpr char busy_[] = "421 Too many connections\r\n";
+        send(fd_, busy_, sizeof(busy_) - 1, MSG_NOSIGNAL);
+        close(fd_);
+        continue;
+      }
+      _nConnections++;
+      Connection& c_ = _connections.emplace_back();
+      c_.fd = fd_;
+      c_.thread = std::thread(&SmtpSink::_serve, this, &c_);
+    }
+  }
+  void _serve(Connection* c) {
+    {
+      Session s_(c->fd, _ctx);
+      if (!_options.implicit_tls || s_.start_tls()) _talk(s_);
+    }
+    close(c->fd);
+    c->done = true;
+  }
+  void _talk(Session& s) {
+    std::string line_{};
+    if (!s.write("220 localhost ESMTP sink\r\n")) return;
+    while (s.read_line(line_)) {
+      std::string cmd_ = line_.substr(0, 4);
+      for (auto& ch : cmd_) ch = static_cast<char>(toupper(ch));
+      bool ok_ = true;
+      if (cmd_ == "EHLO") {
+        ok_ = s.write(_options.starttls && !s.tls()
+                          ? "250-localhost\r\n250-STARTTLS\r\n250-AUTH PLAIN "
+                            "LOGIN\r\n250-8BITMIME\r\n250 SIZE 104857600\r\n"
+                          : "250-localhost\r\n250-AUTH PLAIN LOGIN\r\n"
+                            "250-8BITMIME\r\n250 SIZE 104857600\r\n");
+      } else if (cmd_ == "HELO") {
+        ok_ = s.write("250 localhost\r\n");
+      } else if (cmd_ == "STAR" && _options.starttls && !s.tls()) {
+        ok_ = s.write("220 Ready to start TLS\r\n") && s.start_tls();
+      } else if (cmd_ == "AUTH") {
+        ok_ = _auth(s, line_);
+      } else if (cmd_ == "MAIL") {
+        if (_options.delay_at_mail) _delay();
+        ok_ = s.write("250 OK\r\n");
+      } else if (cmd_ == "RCPT") {
+        ok_ = s.write("250 OK\r\n");
+      } else if (cmd_ == "DATA") {
+        ok_ = s.write("354 End data with <CR><LF>.<CR><LF>\r\n") && _data(s);
+      } else if (cmd_ == "RSET" || cmd_ == "NOOP") {
+        ok_ = s.write("250 OK\r\n");
+      } else if (cmd_ == "QUIT") {
+        s.write("221 Bye\r\n");
+        return;
+      } else {
+        ok_ = s.write("502 Command not implemented\r\n");
+      }
+      if (!ok_) return;
+    }
+  }
+  // Any user and password are accepted
+  bool _auth(Session& s, const std::string& line) {
+    std::string reply_{};
+    bool login_ = line.size() >= 10 && (line[5] == 'L' || line[5] == 'l');
+    // AUTH PLAIN with an initial response has 3 words, AUTH LOGIN has 2
+    size_t words_ = 1;
+    for (size_t i = 1; i < line.size(); ++i)
+      if (line[i] == ' ' && line[i - 1] != ' ') words_++;
+    if (login_) {
+      if (words_ < 3 &&
+          (!s.write("334 VXNlcm5hbWU6\r\n") || !s.read_line(reply_)))
+        return (false);
+      if (!s.write("334 UGFzc3dvcmQ6\r\n") || !s.read_line(reply_))
+        return (false);
+    } else if (words_ < 3) {
+      if (!s.write("334 \r\n") || !s.read_line(reply_)) return (false);
+    }
+    return (s.write("235 Authentication successful\r\n"));
+  }
+  bool _data(Session& s) {
+    std::string line_{};
+    size_t bytes_ = 0;
+    while (true) {
+      if (!s.read_line(line_)) return (false);
+      if (line_ == ".") break;
+      bytes_ += line_.size() + 2;
+    }
+    if (!_options.delay_at_mail) _delay();
+    _nBytes += bytes_;
+    size_t n_ = ++_nMessages;
+    if (_options.fail_every != 0 && n_ % _options.fail_every == 0) {
+      _nFailed++;
+      return (s.write(std::to_string(_options.fail_code) +
+                      " Try again later\r\n"));
+    }
+    return (s.write("250 OK queued\r\n"));
+  }
+  void _delay() {
+    std::this_thread::sleep_for(_options.delay);
+    std::unique_lock<std::mutex> lck_(_hold_mtx);
+    _hold_cv.wait(lck_, [this] { return (!_held); });
+  }
+
+  Options _options;
+  SSL_CTX* _ctx{nullptr};
+  std::string _cert_pem{};
+  int _listen{-1};
+  uint16_t _port{0};
+  std::atomic<bool> _stopping{false};
+  std::thread _acceptor{};
+  std::mutex _mtx{};
+  std::list<Connection> _connections{};
+  std::atomic<size_t> _nConnections{0};
+  std::atomic<size_t> _nRefused{0};
+  std::atomic<size_t> _nMessages{0};
+  std::atomic<size_t> _nFailed{0};
+  std::atomic<size_t> _nBytes{0};
+  std::mutex _hold_mtx{};
+  std::condition_variable _hold_cv{};
+  bool _held{false};
+};
+
+}  // namespace smtp_sink
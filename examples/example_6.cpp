@@ -1,6 +1,7 @@
 #include "libcurlwrappersmtp.hpp"
 #include "login_data.hpp"
 
+#include <array>
 #include <iostream>
 
 const char* smtp_server = SERVER1;
@@ -1,6 +1,7 @@
 #include "libcurlwrappersmtp.hpp"
 #include "login_data.hpp"
 
+#include <array>
 #include <iostream>
 
 std::vector<
@@ -0,0 +1,44 @@
+#include "libcurlwrappersmtp.hpp"
+#include "login_data.hpp"
+
+#include <iostream>
+
+const char* smtp_server = SERVER1;
+const char* username = USERNAME1;
+const char* password = PASSWORD1;
+const char* from_name = FROMNAME1;
+const char* from_email = FROMEMAIL1;
+
+std::vector<libcurlwrappersmtp::MergeRecord> records = {
+    {DESTINATIONNAME1, DESTINATIONEMAIL1, {"Alice", "1234"}},
+    {DESTINATIONNAME2, DESTINATIONEMAIL2, {"Bob", "5678"}}};
+
+std::atomic<int> counter{0};
+
+int main() {
+  using namespace libcurlwrappersmtp;
+  LibCurlWrapperEmail EMAILER{};
+
+  auto tmpl = std::make_shared<const MergeTemplate>(
+      std::vector<std::string>{"name", "code"}, "Hi, {{name}}!",
+      "Dear {{name}}, your code is {{code}}.",
+      "<html><body>Dear <b>{{name}}</b>, your code is "
+      "<i>{{code}}</i>.</body></html>");
+
+  void (*cb)(Request&) = [](Request& req) {
+    if (!req.error.empty())
+      std::cout << "Error: " << req.error << std::endl;
+    else
+      std::cout << "Done!" << std::endl;
+    counter++;
+  };
+  EMAILER << server(smtp_server);
+  EMAILER << user(username, password);
+  EMAILER << from(from_name, from_email);
+  EMAILER << cb;
+  EMAILER.mailmerge(tmpl, records);
+  EMAILER << directive::asyncperform;
+  while (counter < static_cast<int>(records.size()))
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  return (EXIT_SUCCESS);
+}
@@ -0,0 +1,56 @@
+#include "libcurlwrappersmtp.hpp"
+#include "login_data.hpp"
+
+#include <iostream>
+
+const char* smtp_server = SERVER1;
+const char* username = USERNAME1;
+const char* password = PASSWORD1;
+const char* from_name = FROMNAME1;
+const char* from_email = FROMEMAIL1;
+
+std::vector<std::pair<std::string, std::string>> destinations = {
+    {DESTINATIONNAME1, DESTINATIONEMAIL1},
+    {DESTINATIONNAME2, DESTINATIONEMAIL2}};
+
+std::atomic<int> counter{0};
+
+// Coroutine which starts at once and isn't awaited
+struct detached {
+  struct promise_type {
+    detached get_return_object() { return {}; }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+  };
+};
+
+detached send_one(libcurlwrappersmtp::LibCurlWrapperEmail& emailer,
+                  const std::pair<std::string, std::string>& dst) {
+  using namespace libcurlwrappersmtp;
+  Message msg;
+  msg << server(smtp_server) << user(username, password)
+      << from(from_name, from_email)
+      << to(dst.first.c_str(), dst.second.c_str()) << subject("Hi!")
+      << mimetext("text");
+  SendResult res = co_await emailer.send(std::move(msg));
+  if (!res.error.empty())
+    std::cout << "Error: " << res.error << std::endl;
+  else
+    std::cout << "Done! " << res.response_code << " in "
+              << std::chrono::duration_cast<std::chrono::milliseconds>(
+                     res.queued + res.transfer)
+                     .count()
+              << " ms" << std::endl;
+  counter++;
+}
+
+int main() {
+  using namespace libcurlwrappersmtp;
+  LibCurlWrapperEmail EMAILER{};
+  for (const auto& dst : destinations) send_one(EMAILER, dst);
+  while (counter < static_cast<int>(destinations.size()))
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  return (EXIT_SUCCESS);
+}
@@ -1,16 +1,52 @@
 #pragma once
 
+#include <array>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cerrno>
 #include <condition_variable>
+#include <cstdio>
 #include <cstring>
+#include <deque>
 #include <future>
+#include <list>
 #include <map>
 #include <memory>
 #include <mutex>
 #include <random>
+#include <shared_mutex>
+#include <stdexcept>
+#include <string_view>
 #include <thread>
+#include <unordered_map>
 #include <vector>
 
 #include <curl/curl.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <strings.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define LIBCURLWRAPPERSMTP_X86 1
+#include <immintrin.h>
+#else
+#define LIBCURLWRAPPERSMTP_X86 0
+#endif
+
+// co_await LibCurlWrapperEmail::send() with C++20 coroutines
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#define LIBCURLWRAPPERSMTP_COROUTINES 1
+#include <coroutine>
+#else
+#define LIBCURLWRAPPERSMTP_COROUTINES 0
+#endif
 
 namespace libcurlwrappersmtp {
 
@@ -39,15 +75,53 @@ struct userdata {
   userdata() = delete;
   userdata(void* data) : ptr(data) {}
 };
+// Tag for bodies in caller-owned buffers
+struct borrow_t {
+  explicit borrow_t() = default;
+};
+inline constexpr borrow_t borrow{};
+// Bytes of a message body, handed to libcurl without copying. A body
+// without an owner is caller-owned: the buffer must stay valid until the
+// callback of the request is called.
+struct Body {
+  std::shared_ptr<const std::string> owner{};
+  std::string_view view{};
+  Body() = default;
+  // Copied once
+  Body(const char* d)
+      : owner(std::make_shared<const std::string>(d != nullptr ? d : "")),
+        view(*owner) {}
+  Body(const std::string& d)
+      : owner(std::make_shared<const std::string>(d)), view(*owner) {}
+  // Moved, without copying the bytes
+  Body(std::string&& d)
+      : owner(std::make_shared<const std::string>(std::move(d))),
+        view(*owner) {}
+  // Shared between requests
+  Body(std::shared_ptr<const std::string> d) : owner(std::move(d)) {
+    if (owner) view = *owner;
+  }
+  // Caller-owned
+  Body(std::string_view d, borrow_t) : view(d) {}
+  bool empty() const noexcept { return (view.empty()); }
+};
 struct mimehtml {
-  const char* data{nullptr};
+  Body body{};
   mimehtml() = delete;
-  mimehtml(const char* d) : data(d) {}
+  mimehtml(const char* d) : body(d) {}
+  mimehtml(const std::string& d) : body(d) {}
+  mimehtml(std::string&& d) : body(std::move(d)) {}
+  mimehtml(std::shared_ptr<const std::string> d) : body(std::move(d)) {}
+  mimehtml(std::string_view d, borrow_t b) : body(d, b) {}
 };
 struct mimetext {
-  const char* data{nullptr};
+  Body body{};
   mimetext() = delete;
-  mimetext(const char* d) : data(d) {}
+  mimetext(const char* d) : body(d) {}
+  mimetext(const std::string& d) : body(d) {}
+  mimetext(std::string&& d) : body(std::move(d)) {}
+  mimetext(std::shared_ptr<const std::string> d) : body(std::move(d)) {}
+  mimetext(std::string_view d, borrow_t b) : body(d, b) {}
 };
 struct mimefile {
   const char* filename{nullptr};
@@ -71,18 +145,1280 @@ struct subject {
   subject() = delete;
   subject(const char* u) : subj(u) {}
 };
+class PreparedMessage;
+struct prepared {
+  std::shared_ptr<const PreparedMessage> msg{};
+  prepared() = delete;
+  prepared(std::shared_ptr<const PreparedMessage> m) : msg(std::move(m)) {}
+};
+class DkimSigner;
+struct dkim {
+  std::shared_ptr<const DkimSigner> signer{};
+  dkim() = delete;
+  // Keys are parsed once for each selector, domain and key, and again
+  // when the key file changes. Throws std::runtime_error if the key can't
+  // be read.
+  dkim(const char* domain, const char* selector, const char* key);
+  dkim(std::shared_ptr<const DkimSigner> s) : signer(std::move(s)) {}
+};
 
 enum class directive : unsigned char {
   syncperform,
   asyncperform,
+  asyncperform_high,  // asyncperform in the high priority lane
   verbose,
 };
+// Lanes of async requests. Higher lanes are started first.
+enum class priority : unsigned char {
+  high,    // Password resets, login codes
+  normal,
+  bulk,    // Campaigns
+};
+// What asyncperform does when the async queue is full
+enum class overflow : unsigned char {
+  block,   // Wait for free space
+  reject,  // Keep requests in the local queue, submit() returns false
+  drop,    // Call callbacks with an error, submit() returns false
+};
+// Where callbacks of async requests run
+enum class completion : unsigned char {
+  worker,   // On the worker thread, after the transfer
+  threads,  // On a pool of callback threads
+  poll,     // In poll_completions(), see completion_fd()
+};
 
 class KeepAliveServers;
+struct ServerData;
 class LibCurlWrapperEmail;
+class Message;
+class CompletionQueue;
+class Spool;
+class Metrics;
+struct Request;
+class RequestPool;
+// Returns requests to the pool instead of deleting them
+struct RequestRecycler {
+  void operator()(Request* req) const noexcept;
+};
+using RequestPtr = std::unique_ptr<Request, RequestRecycler>;
+
+// Instruction sets of the encoders. The best one is picked at runtime.
+enum class isa : unsigned char {
+  scalar,
+  ssse3,  // SSE2 for quoted-printable
+  avx2,
+};
+inline isa best_isa() noexcept {
+#if LIBCURLWRAPPERSMTP_X86
+  static const isa isa_ = []() {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return (isa::avx2);
+    if (__builtin_cpu_supports("ssse3")) return (isa::ssse3);
+    return (isa::scalar);
+  }();
+  return (isa_);
+#else
+  return (isa::scalar);
+#endif
+}
+
+inline constexpr char _base64_table[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+// Base64 without line breaks, the last group is padded
+inline char* _base64_scalar(const unsigned char* in, size_t size,
+                            char* out) noexcept {
+  size_t i = 0;
+  for (; i + 3 <= size; i += 3) {
+    uint32_t n_ = static_cast<uint32_t>(in[i]) << 16 |
+                  static_cast<uint32_t>(in[i + 1]) << 8 | in[i + 2];
+    *out++ = _base64_table[(n_ >> 18) & 0x3F];
+    *out++ = _base64_table[(n_ >> 12) & 0x3F];
+    *out++ = _base64_table[(n_ >> 6) & 0x3F];
+    *out++ = _base64_table[n_ & 0x3F];
+  }
+  if (i < size) {
+    uint32_t n_ = static_cast<uint32_t>(in[i]) << 16;
+    if (i + 1 < size) n_ |= static_cast<uint32_t>(in[i + 1]) << 8;
+    *out++ = _base64_table[(n_ >> 18) & 0x3F];
+    *out++ = _base64_table[(n_ >> 12) & 0x3F];
+    *out++ = i + 1 < size ? _base64_table[(n_ >> 6) & 0x3F] : '=';
+    *out++ = '=';
+  }
+  return (out);
+}
+// Bytes kept as they are by quoted-printable: printable ASCII but '=',
+// and spaces
+inline size_t _qp_run_scalar(const unsigned char* in, size_t size) noexcept {
+  size_t i = 0;
+  while (i < size &&
+         ((in[i] >= 33 && in[i] <= 126 && in[i] != '=') || in[i] == ' '))
+    ++i;
+  return (i);
+}
+// Position of the first control or 8bit byte
+inline size_t _special_scalar(const unsigned char* in, size_t size) noexcept {
+  size_t i = 0;
+  while (i < size && in[i] >= 32 && in[i] < 127) ++i;
+  return (i);
+}
+
+#if LIBCURLWRAPPERSMTP_X86
+// 12 bytes of in to 16 characters, see "Faster Base64 Encoding and
+// Decoding Using AVX2 Instructions" by W. Mula and D. Lemire
+__attribute__((target("ssse3"))) inline __m128i _base64_ssse3(__m128i in) {
+  in = _mm_shuffle_epi8(
+      in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+  __m128i t0_ = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+  __m128i t1_ = _mm_mulhi_epu16(t0_, _mm_set1_epi32(0x04000040));
+  __m128i t2_ = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+  __m128i t3_ = _mm_mullo_epi16(t2_, _mm_set1_epi32(0x01000010));
+  __m128i indices_ = _mm_or_si128(t1_, t3_);
+  __m128i result_ = _mm_subs_epu8(indices_, _mm_set1_epi8(51));
+  __m128i less_ = _mm_cmpgt_epi8(_mm_set1_epi8(26), indices_);
+  result_ = _mm_or_si128(result_, _mm_and_si128(less_, _mm_set1_epi8(13)));
+  __m128i shift_ = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52,
+                                 '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                 '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+                                 '/' - 63, 'A', 0, 0);
+  result_ = _mm_shuffle_epi8(shift_, result_);
+  return (_mm_add_epi8(result_, indices_));
+}
+__attribute__((target("avx2"))) inline __m256i _base64_avx2(__m256i in) {
+  in = _mm256_shuffle_epi8(
+      in, _mm256_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1,
+                          10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+  __m256i t0_ = _mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00));
+  __m256i t1_ = _mm256_mulhi_epu16(t0_, _mm256_set1_epi32(0x04000040));
+  __m256i t2_ = _mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0));
+  __m256i t3_ = _mm256_mullo_epi16(t2_, _mm256_set1_epi32(0x01000010));
+  __m256i indices_ = _mm256_or_si256(t1_, t3_);
+  __m256i result_ = _mm256_subs_epu8(indices_, _mm256_set1_epi8(51));
+  __m256i less_ = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), indices_);
+  result_ =
+      _mm256_or_si256(result_, _mm256_and_si256(less_, _mm256_set1_epi8(13)));
+  __m256i shift_ = _mm256_setr_epi8(
+      'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+      '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0,
+      'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+      '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+  result_ = _mm256_shuffle_epi8(shift_, result_);
+  return (_mm256_add_epi8(result_, indices_));
+}
+// The first 48 of the 57 bytes of a line. Loads stay inside the line.
+__attribute__((target("ssse3"))) inline void _base64_line_ssse3(
+    const unsigned char* in, char* out) noexcept {
+  for (int i = 0; i < 4; ++i) {
+    __m128i in_ =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + 12 * i));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 16 * i),
+                     _base64_ssse3(in_));
+  }
+}
+__attribute__((target("avx2"))) inline void _base64_line_avx2(
+    const unsigned char* in, char* out) noexcept {
+  for (int i = 0; i < 2; ++i) {
+    __m128i lo_ =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + 24 * i));
+    __m128i hi_ =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + 24 * i + 12));
+    __m256i in_ =
+        _mm256_inserti128_si256(_mm256_castsi128_si256(lo_), hi_, 1);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + 32 * i),
+                        _base64_avx2(in_));
+  }
+}
+__attribute__((target("sse2"))) inline size_t _qp_run_sse2(
+    const unsigned char* in, size_t size) noexcept {
+  size_t i = 0;
+  for (; i + 16 <= size; i += 16) {
+    __m128i v_ = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+    __m128i keep_ = _mm_and_si128(_mm_cmpgt_epi8(v_, _mm_set1_epi8(32)),
+                                  _mm_cmplt_epi8(v_, _mm_set1_epi8(127)));
+    keep_ = _mm_andnot_si128(_mm_cmpeq_epi8(v_, _mm_set1_epi8('=')), keep_);
+    keep_ = _mm_or_si128(keep_, _mm_cmpeq_epi8(v_, _mm_set1_epi8(' ')));
+    auto mask_ = static_cast<unsigned>(_mm_movemask_epi8(keep_));
+    if (mask_ != 0xFFFF) return (i + __builtin_ctz(~mask_));
+  }
+  return (i + _qp_run_scalar(in + i, size - i));
+}
+__attribute__((target("avx2"))) inline size_t _qp_run_avx2(
+    const unsigned char* in, size_t size) noexcept {
+  size_t i = 0;
+  for (; i + 32 <= size; i += 32) {
+    __m256i v_ = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i));
+    __m256i keep_ =
+        _mm256_and_si256(_mm256_cmpgt_epi8(v_, _mm256_set1_epi8(32)),
+                         _mm256_cmpgt_epi8(_mm256_set1_epi8(127), v_));
+    keep_ = _mm256_andnot_si256(_mm256_cmpeq_epi8(v_, _mm256_set1_epi8('=')),
+                                keep_);
+    keep_ = _mm256_or_si256(keep_, _mm256_cmpeq_epi8(v_, _mm256_set1_epi8(' ')));
+    auto mask_ = static_cast<uint32_t>(_mm256_movemask_epi8(keep_));
+    if (mask_ != 0xFFFFFFFFu) return (i + __builtin_ctz(~mask_));
+  }
+  return (i + _qp_run_sse2(in + i, size - i));
+}
+__attribute__((target("sse2"))) inline size_t _special_sse2(
+    const unsigned char* in, size_t size) noexcept {
+  size_t i = 0;
+  for (; i + 16 <= size; i += 16) {
+    __m128i v_ = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+    // Bytes from 128 are negative
+    __m128i special_ = _mm_or_si128(_mm_cmplt_epi8(v_, _mm_set1_epi8(32)),
+                                    _mm_cmpeq_epi8(v_, _mm_set1_epi8(127)));
+    auto mask_ = static_cast<unsigned>(_mm_movemask_epi8(special_));
+    if (mask_ != 0) return (i + __builtin_ctz(mask_));
+  }
+  return (i + _special_scalar(in + i, size - i));
+}
+#endif
+
+// Base64 with lines of 76 characters, as required for MIME bodies
+inline void base64_encode(const char* data, size_t size, std::string& out,
+                          isa set) {
+  const auto* in_ = reinterpret_cast<const unsigned char*>(data);
+  size_t chars_ = (size + 2) / 3 * 4;
+  size_t breaks_ = chars_ == 0 ? 0 : (chars_ - 1) / 76;
+  size_t old_ = out.size();
+  out.resize(old_ + chars_ + breaks_ * 2);
+  char* out_ = &out[old_];
+  size_t i = 0;
+  // 57 bytes per line
+  for (; i + 57 <= size; i += 57) {
+    switch (set) {
+#if LIBCURLWRAPPERSMTP_X86
+      case isa::avx2:
+        _base64_line_avx2(in_ + i, out_);
+        break;
+      case isa::ssse3:
+        _base64_line_ssse3(in_ + i, out_);
+        break;
+#endif
+      default:
+        _base64_scalar(in_ + i, 48, out_);
+    }
+    _base64_scalar(in_ + i + 48, 9, out_ + 64);
+    out_ += 76;
+    if (i + 57 < size) {
+      *out_++ = '\r';
+      *out_++ = '\n';
+    }
+  }
+  _base64_scalar(in_ + i, size - i, out_);
+}
+inline void base64_encode(const char* data, size_t size, std::string& out) {
+  base64_encode(data, size, out, best_isa());
+}
+// Quoted-printable with lines of 76 characters. Line breaks of the text
+// are sent as CRLF.
+inline void quoted_printable_encode(const char* data, size_t size,
+                                    std::string& out, isa set) {
+  static const char* hex_ = "0123456789ABCDEF";
+  const auto* in_ = reinterpret_cast<const unsigned char*>(data);
+  // Every byte escaped, and a soft line break per 25 bytes
+  size_t old_ = out.size();
+  out.resize(old_ + size * 3 + (size / 25 + 2) * 3);
+  char* const begin_ = &out[old_];
+  char* out_ = begin_;
+  char* line_ = begin_;
+  auto soft_break_ = [&](size_t n) {
+    if (out_ - line_ + n <= 75) return;
+    memcpy(out_, "=\r\n", 3);
+    out_ += 3;
+    line_ = out_;
+  };
+  auto escape_ = [&](unsigned char c) {
+    soft_break_(3);
+    out_[0] = '=';
+    out_[1] = hex_[c >> 4];
+    out_[2] = hex_[c & 0x0F];
+    out_ += 3;
+  };
+  // Spaces at the end of a line are encoded
+  auto end_line_ = [&]() {
+    if (out_ == line_ || (out_[-1] != ' ' && out_[-1] != '\t')) return;
+    auto c_ = static_cast<unsigned char>(*--out_);
+    escape_(c_);
+  };
+  size_t i = 0;
+  while (i < size) {
+    size_t run_ = 0;
+    switch (set) {
+#if LIBCURLWRAPPERSMTP_X86
+      case isa::avx2:
+        run_ = _qp_run_avx2(in_ + i, size - i);
+        break;
+      case isa::ssse3:
+        run_ = _qp_run_sse2(in_ + i, size - i);
+        break;
+#endif
+      default:
+        run_ = _qp_run_scalar(in_ + i, size - i);
+    }
+    while (run_ != 0) {
+      soft_break_(1);
+      size_t n_ = std::min<size_t>(run_, 75 - (out_ - line_));
+      memcpy(out_, data + i, n_);
+      out_ += n_;
+      i += n_;
+      run_ -= n_;
+    }
+    if (i == size) break;
+    unsigned char c_ = in_[i];
+    if (c_ == '\n' || (c_ == '\r' && i + 1 < size && in_[i + 1] == '\n')) {
+      end_line_();
+      *out_++ = '\r';
+      *out_++ = '\n';
+      line_ = out_;
+      i += c_ == '\r' ? 2 : 1;
+    } else if (c_ == '\t') {
+      soft_break_(1);
+      *out_++ = '\t';
+      i++;
+    } else {
+      escape_(c_);
+      i++;
+    }
+  }
+  end_line_();
+  out.resize(old_ + (out_ - begin_));
+}
+inline void quoted_printable_encode(const char* data, size_t size,
+                                    std::string& out) {
+  quoted_printable_encode(data, size, out, best_isa());
+}
+// Whether a text can't be sent as 7bit: it has 8bit bytes, control
+// characters or lines over 998 bytes
+inline bool needs_transfer_encoding(std::string_view text) noexcept {
+  const auto* in_ = reinterpret_cast<const unsigned char*>(text.data());
+  size_t line_start_ = 0;
+  size_t i = 0;
+  while (true) {
+#if LIBCURLWRAPPERSMTP_X86
+    i += _special_sse2(in_ + i, text.size() - i);
+#else
+    i += _special_scalar(in_ + i, text.size() - i);
+#endif
+    if (i == text.size()) break;
+    if (in_[i] == '\n') {
+      if (i - line_start_ > 998) return (true);
+      line_start_ = i + 1;
+    } else if (in_[i] != '\r' && in_[i] != '\t') {
+      return (true);
+    }
+    i++;
+  }
+  return (text.size() - line_start_ > 998);
+}
+// Header text, as RFC 2047 encoded-words if it isn't printable ASCII
+inline void encode_header(std::string_view text, std::string& out) {
+  if (!needs_transfer_encoding(text) &&
+      text.find_first_of("\r\n") == std::string_view::npos) {
+    out.append(text);
+    return;
+  }
+  // 45 bytes are 60 characters, a word fits a folded line
+  size_t i = 0;
+  while (i < text.size()) {
+    size_t n_ = std::min<size_t>(45, text.size() - i);
+    // UTF-8 sequences aren't split between words
+    size_t whole_ = n_;
+    while (whole_ != 0 && i + whole_ < text.size() &&
+           (static_cast<unsigned char>(text[i + whole_]) & 0xC0) == 0x80)
+      --whole_;
+    if (whole_ != 0) n_ = whole_;
+    if (i != 0) out.append("\r\n ");
+    out.append("=?UTF-8?B?");
+    base64_encode(text.data() + i, n_, out);
+    out.append("?=");
+    i += n_;
+  }
+}
+// Random numbers for boundaries and Message-IDs: splitmix64 for each
+// thread, seeded once
+inline uint64_t fast_random() noexcept {
+  thread_local uint64_t state_ =
+      (static_cast<uint64_t>(std::random_device{}()) << 32 |
+       std::random_device{}()) ^
+      reinterpret_cast<uintptr_t>(&state_);
+  uint64_t z_ = (state_ += 0x9e3779b97f4a7c15ULL);
+  z_ = (z_ ^ (z_ >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z_ = (z_ ^ (z_ >> 27)) * 0x94d049bb133111ebULL;
+  return (z_ ^ (z_ >> 31));
+}
+// Date header of the current second. It is formatted once per second
+// in each thread.
+inline std::string_view date_header() noexcept {
+  thread_local time_t time_ = 0;
+  thread_local char buffer_[80];
+  thread_local size_t size_ = 0;
+  time_t now_ = time(nullptr);
+  if (now_ != time_) {
+    struct tm tm_ {};
+    localtime_r(&now_, &tm_);
+    size_ = strftime(buffer_, sizeof(buffer_), "Date: %a, %e %b %Y %T %z",
+                     &tm_);
+    time_ = now_;
+  }
+  return (std::string_view(buffer_, size_));
+}
+// Random MIME boundary, without allocations
+class MimeBoundary {
+ public:
+  MimeBoundary() noexcept {
+    static const char* hex_ = "0123456789abcdef";
+    memset(_data, '-', 24);
+    uint64_t value_ = fast_random();
+    for (int i = 39; i >= 24; --i, value_ >>= 4) _data[i] = hex_[value_ & 0x0F];
+  }
+  operator std::string_view() const noexcept {
+    return (std::string_view(_data, sizeof(_data)));
+  }
+
+ private:
+  char _data[40];
+};
+// MIME type of a file by its extension, for the types which curl knows.
+// Others are application/octet-stream.
+inline const char* content_type(std::string_view filename) noexcept {
+  static const std::pair<const char*, const char*> types_[] = {
+      {".gif", "image/gif"},       {".jpg", "image/jpeg"},
+      {".jpeg", "image/jpeg"},     {".png", "image/png"},
+      {".svg", "image/svg+xml"},   {".txt", "text/plain"},
+      {".htm", "text/html"},       {".html", "text/html"},
+      {".pdf", "application/pdf"}, {".xml", "application/xml"}};
+  for (const auto& type : types_) {
+    size_t size_ = strlen(type.first);
+    if (filename.size() > size_ &&
+        strncasecmp(filename.data() + filename.size() - size_, type.first,
+                    size_) == 0)
+      return (type.second);
+  }
+  return ("application/octet-stream");
+}
+// A serialized RFC 5322 message. Generated bytes are written into one
+// buffer, bodies and attachments held elsewhere are referenced in place.
+class MessageWriter {
+ public:
+  void clear() noexcept {
+    _head.clear();
+    _buffer.clear();
+    _refs.clear();
+    _refs_size = 0;
+  }
+  void reserve(size_t bytes) { _buffer.reserve(bytes); }
+  // Release the buffers of an empty writer if they are over max bytes
+  void trim(size_t max) noexcept {
+    if (_buffer.capacity() > max) std::string().swap(_buffer);
+    if (_refs.capacity() * sizeof(Ref) > max) std::vector<Ref>().swap(_refs);
+  }
+  // Generated bytes are appended to the buffer
+  std::string& buffer() noexcept { return (_buffer); }
+  void append(std::string_view data) { _buffer.append(data); }
+  // The data must stay valid until the message is sent
+  void reference(std::string_view data) {
+    if (data.empty()) return;
+    _refs.push_back({_buffer.size(), data});
+    _refs_size += data.size();
+  }
+  // A header field written before all others, like DKIM-Signature
+  void prepend(std::string field) { _head = std::move(field); }
+  // Exact size of the message
+  size_t size() const noexcept {
+    return (_head.size() + _buffer.size() + _refs_size);
+  }
+  // The message as segments, in order. Valid until the writer is changed.
+  void segments(std::vector<std::string_view>& out) const {
+    out.clear();
+    out.reserve(_refs.size() * 2 + 2);
+    if (!_head.empty()) out.emplace_back(_head);
+    size_t pos_ = 0;
+    for (const auto& ref : _refs) {
+      if (ref.offset > pos_)
+        out.emplace_back(_buffer.data() + pos_, ref.offset - pos_);
+      out.push_back(ref.data);
+      pos_ = ref.offset;
+    }
+    if (_buffer.size() > pos_)
+      out.emplace_back(_buffer.data() + pos_, _buffer.size() - pos_);
+  }
+  // The message in one buffer
+  void flatten(std::string& out) const {
+    out.clear();
+    out.reserve(size());
+    out.append(_head);
+    size_t pos_ = 0;
+    for (const auto& ref : _refs) {
+      out.append(_buffer, pos_, ref.offset - pos_);
+      out.append(ref.data);
+      pos_ = ref.offset;
+    }
+    out.append(_buffer, pos_, std::string::npos);
+  }
+  // Headers of a multipart/mixed message with a multipart/alternative part
+  // for text and HTML
+  void begin_multipart(std::string_view mixed, std::string_view alt) {
+    _buffer.append("MIME-Version: 1.0\r\n");
+    _buffer.append("Content-Type: multipart/mixed; boundary=\"");
+    _buffer.append(mixed);
+    _buffer.append("\"\r\n\r\n--");
+    _buffer.append(mixed);
+    _buffer.append("\r\nContent-Type: multipart/alternative; boundary=\"");
+    _buffer.append(alt);
+    _buffer.append("\"\r\nContent-Disposition: inline\r\n\r\n");
+  }
+  // Headers of a text part. The text follows, then end_part().
+  void begin_text(std::string_view boundary, const char* type,
+                  bool quoted_printable) {
+    _buffer.append("--");
+    _buffer.append(boundary);
+    _buffer.append("\r\nContent-Type: ");
+    _buffer.append(type);
+    if (quoted_printable)
+      _buffer.append(
+          "; charset=utf-8\r\n"
+          "Content-Transfer-Encoding: quoted-printable");
+    _buffer.append("\r\n\r\n");
+  }
+  // A text, quoted-printable into encoded if it isn't 7bit
+  void text(std::string_view boundary, const char* type,
+            std::string_view text, std::string& encoded) {
+    encoded.clear();
+    if (text.empty()) return;
+    bool encode_ = needs_transfer_encoding(text);
+    begin_text(boundary, type, encode_);
+    if (encode_) {
+      quoted_printable_encode(text.data(), text.size(), encoded);
+      reference(encoded);
+    } else {
+      reference(text);
+    }
+    end_part();
+  }
+  // An attachment, data is base64 encoded
+  void attachment(std::string_view boundary, const std::string& filename,
+                  std::string_view data) {
+    auto name_ =
+        std::string_view(filename).substr(filename.find_last_of('/') + 1);
+    _buffer.append("--");
+    _buffer.append(boundary);
+    _buffer.append("\r\nContent-Type: ");
+    _buffer.append(content_type(name_));
+    _parameter("name", name_);
+    _buffer.append("\r\nContent-Disposition: attachment");
+    _parameter("filename", name_);
+    _buffer.append("\r\nContent-Transfer-Encoding: base64\r\n\r\n");
+    reference(data);
+    end_part();
+  }
+  void end_part() { _buffer.append("\r\n"); }
+  void end_multipart(std::string_view boundary) {
+    _buffer.append("--");
+    _buffer.append(boundary);
+    _buffer.append("--\r\n");
+  }
+
+ private:
+  // Referenced data, inserted at the offset of the buffer
+  struct Ref {
+    size_t offset;
+    std::string_view data;
+  };
+  std::string _head{};
+  std::string _buffer{};
+  std::vector<Ref> _refs{};
+  size_t _refs_size{0};
+
+  // A header parameter: a quoted string if the value is short printable
+  // ASCII, otherwise percent-encoded UTF-8 (RFC 2231) in sections on
+  // folded lines. A section doesn't split a UTF-8 sequence.
+  void _parameter(std::string_view attribute, std::string_view value) {
+    bool quoted_ = value.size() <= 60;
+    for (char c : value)
+      quoted_ = quoted_ && static_cast<unsigned char>(c) >= 0x20 &&
+                static_cast<unsigned char>(c) < 0x7F;
+    if (quoted_) {
+      _buffer.append("; ");
+      _buffer.append(attribute);
+      _buffer.append("=\"");
+      for (char c : value) {
+        if (c == '"' || c == '\\') _buffer.push_back('\\');
+        _buffer.push_back(c);
+      }
+      _buffer.push_back('"');
+      return;
+    }
+    auto plain_ = [](unsigned char c) {
+      return ((c < 0x80 && isalnum(c)) ||
+              (c != 0 && strchr("!#$&+-.^_`|~", c) != nullptr));
+    };
+    size_t encoded_ = 0;
+    for (char c : value)
+      encoded_ += plain_(static_cast<unsigned char>(c)) ? 1 : 3;
+    static const char* hex_ = "0123456789ABCDEF";
+    size_t section_ = 0;
+    size_t line_ = 0;
+    for (char c : value) {
+      auto c_ = static_cast<unsigned char>(c);
+      if (section_ == 0 || (line_ >= 60 && (c_ & 0xC0) != 0x80)) {
+        _buffer.append(";\r\n ");
+        _buffer.append(attribute);
+        if (encoded_ > 60) {
+          _buffer.push_back('*');
+          _buffer.append(std::to_string(section_));
+        }
+        _buffer.append(section_ == 0 ? "*=UTF-8''" : "*=");
+        section_++;
+        line_ = 0;
+      }
+      if (plain_(c_)) {
+        _buffer.push_back(c);
+        line_++;
+      } else {
+        _buffer.push_back('%');
+        _buffer.push_back(hex_[c_ >> 4]);
+        _buffer.push_back(hex_[c_ & 0x0F]);
+        line_ += 3;
+      }
+    }
+  }
+};
+// DKIM signatures (RFC 6376, RFC 8463) with relaxed/relaxed
+// canonicalization. Signatures are rsa-sha256 or ed25519-sha256, by the
+// type of the key.
+
+// SHA-256 of a body in relaxed canonical form, fed in pieces
+class DkimBodyHash {
+ public:
+  DkimBodyHash() : _ctx(EVP_MD_CTX_new()) {
+    EVP_DigestInit_ex(_ctx, EVP_sha256(), nullptr);
+  }
+  DkimBodyHash(const DkimBodyHash&) = delete;
+  DkimBodyHash& operator=(const DkimBodyHash&) = delete;
+  ~DkimBodyHash() { EVP_MD_CTX_free(_ctx); }
+  void update(std::string_view data) {
+    for (char c : data) {
+      if (_cr) {
+        _cr = false;
+        if (c == '\n') {
+          _end_line();
+          continue;
+        }
+        _char('\r');
+      }
+      switch (c) {
+        case '\r':
+          _cr = true;
+          break;
+        case '\n':
+          _end_line();
+          break;
+        case ' ':
+        case '\t':
+          _space = true;
+          break;
+        default:
+          _char(c);
+      }
+    }
+  }
+  // The bh= tag: base64 of the hash
+  std::string finish() {
+    if (_cr) _char('\r');
+    // Empty lines at the end are removed, the last line ends with CRLF
+    if (_line || (_text && _empty_lines != 0)) _put("\r\n", 2);
+    _flush();
+    unsigned char hash_[EVP_MAX_MD_SIZE];
+    unsigned int size_ = 0;
+    EVP_DigestFinal_ex(_ctx, hash_, &size_);
+    std::string out_;
+    base64_encode(reinterpret_cast<const char*>(hash_), size_, out_);
+    return (out_);
+  }
+
+ private:
+  EVP_MD_CTX* _ctx;
+  char _buffer[4096];
+  size_t _used{0};
+  // CRLFs which are written only if more text follows
+  size_t _empty_lines{0};
+  bool _space{false};
+  bool _cr{false};
+  bool _line{false};
+  bool _text{false};
+
+  void _flush() {
+    EVP_DigestUpdate(_ctx, _buffer, _used);
+    _used = 0;
+  }
+  void _put(const char* data, size_t size) {
+    if (_used + size > sizeof(_buffer)) _flush();
+    memcpy(_buffer + _used, data, size);
+    _used += size;
+  }
+  // Spaces are reduced to one, and removed at the end of a line
+  void _char(char c) {
+    for (; _empty_lines != 0; --_empty_lines) _put("\r\n", 2);
+    if (_space) _put(" ", 1);
+    _space = false;
+    _put(&c, 1);
+    _line = true;
+    _text = true;
+  }
+  void _end_line() {
+    _empty_lines++;
+    _space = false;
+    _line = false;
+  }
+};
+inline std::string dkim_hash_body(std::string_view body) {
+  DkimBodyHash hash_{};
+  hash_.update(body);
+  return (hash_.finish());
+}
+// Signs messages for a domain and selector
+class DkimSigner {
+ public:
+  DkimSigner() = delete;
+  DkimSigner(const DkimSigner&) = delete;
+  DkimSigner& operator=(const DkimSigner&) = delete;
+  // key is a PEM private key or the path of a PEM file. Throws
+  // std::runtime_error if it can't be read.
+  DkimSigner(std::string domain, std::string selector, const std::string& key)
+      : _domain(std::move(domain)), _selector(std::move(selector)) {
+    BIO* bio_ = key.compare(0, 10, "-----BEGIN") == 0
+                    ? BIO_new_mem_buf(key.data(), static_cast<int>(key.size()))
+                    : BIO_new_file(key.c_str(), "r");
+    if (bio_ != nullptr) {
+      _key = PEM_read_bio_PrivateKey(bio_, nullptr, nullptr, nullptr);
+      BIO_free(bio_);
+    }
+    if (_key == nullptr)
+      throw std::runtime_error("Can't read DKIM key for " + _domain);
+    if (EVP_PKEY_get_base_id(_key) == EVP_PKEY_ED25519) {
+      _algorithm = "ed25519-sha256";
+    } else if (EVP_PKEY_get_base_id(_key) != EVP_PKEY_RSA) {
+      EVP_PKEY_free(_key);
+      throw std::runtime_error("DKIM key for " + _domain +
+                               " isn't RSA or Ed25519");
+    }
+  }
+  ~DkimSigner() { EVP_PKEY_free(_key); }
+  const std::string& domain() const noexcept { return (_domain); }
+  const std::string& selector() const noexcept { return (_selector); }
+  // DKIM-Signature field with CRLF, for the header blocks of a message and
+  // the bh= of its body. Throws std::runtime_error if signing fails.
+  std::string sign(const std::vector<std::string_view>& header_blocks,
+                   std::string_view body_hash, time_t timestamp) const {
+    static const char* signed_[] = {"from",       "to",           "cc",
+                                    "reply-to",   "subject",      "date",
+                                    "message-id", "mime-version", "content-type"};
+    std::vector<std::string_view> fields_;
+    for (const auto& block : header_blocks) _fields(block, fields_);
+    std::string data_;
+    data_.reserve(1024);
+    std::string names_;
+    for (const char* name : signed_) {
+      // The last instance of a field is signed
+      for (auto it_ = fields_.rbegin(); it_ != fields_.rend(); ++it_) {
+        if (!_is_field(*it_, name)) continue;
+        if (!names_.empty()) names_.push_back(':');
+        names_.append(name);
+        _relaxed(*it_, data_);
+        data_.append("\r\n");
+        break;
+      }
+    }
+    std::string field_ = "DKIM-Signature: v=1; a=";
+    field_.append(_algorithm);
+    field_.append("; c=relaxed/relaxed; d=");
+    field_.append(_domain);
+    field_.append("; s=");
+    field_.append(_selector);
+    field_.append(";\r\n\tt=");
+    field_.append(std::to_string(timestamp));
+    field_.append("; h=");
+    field_.append(names_);
+    field_.append(";\r\n\tbh=");
+    field_.append(body_hash);
+    field_.append(";\r\n\tb=");
+    _relaxed(field_, data_);
+    field_.append(_sign(data_));
+    field_.append("\r\n");
+    return (field_);
+  }
+  // Signs a complete message
+  std::string sign(std::string_view message,
+                   time_t timestamp = time(nullptr)) const {
+    size_t end_ = message.find("\r\n\r\n");
+    end_ = end_ == std::string_view::npos ? message.size() : end_ + 4;
+    return (sign({message.substr(0, end_)},
+                 dkim_hash_body(message.substr(end_)), timestamp));
+  }
+
+ private:
+  std::string _domain{};
+  std::string _selector{};
+  EVP_PKEY* _key{nullptr};
+  const char* _algorithm{"rsa-sha256"};
+
+  // Unfolded fields up to the end of the header block
+  static void _fields(std::string_view block,
+                      std::vector<std::string_view>& fields) {
+    size_t pos_ = 0;
+    while (pos_ < block.size()) {
+      size_t end_ = block.find("\r\n", pos_);
+      if (end_ == std::string_view::npos) end_ = block.size();
+      if (end_ == pos_) break;
+      if ((block[pos_] == ' ' || block[pos_] == '\t') && !fields.empty())
+        fields.back() = std::string_view(
+            fields.back().data(),
+            static_cast<size_t>(block.data() + end_ - fields.back().data()));
+      else
+        fields.emplace_back(block.data() + pos_, end_ - pos_);
+      pos_ = end_ + 2;
+    }
+  }
+  static bool _is_field(std::string_view field, const char* name) noexcept {
+    size_t size_ = strlen(name);
+    if (field.size() <= size_) return (false);
+    for (size_t i = 0; i < size_; ++i)
+      if (tolower(static_cast<unsigned char>(field[i])) != name[i])
+        return (false);
+    size_t colon_ = field.find_first_not_of(" \t", size_);
+    return (colon_ != std::string_view::npos && field[colon_] == ':');
+  }
+  // Lowercase name, unfolded value with spaces reduced to one
+  static void _relaxed(std::string_view field, std::string& out) {
+    size_t colon_ = field.find(':');
+    std::string_view name_ = field.substr(0, colon_);
+    while (!name_.empty() && (name_.back() == ' ' || name_.back() == '\t'))
+      name_.remove_suffix(1);
+    for (char c : name_)
+      out.push_back(static_cast<char>(tolower(static_cast<unsigned char>(c))));
+    out.push_back(':');
+    bool space_ = false;
+    bool value_ = false;
+    for (char c : field.substr(colon_ + 1)) {
+      if (c == '\r' || c == '\n') continue;
+      if (c == ' ' || c == '\t') {
+        space_ = true;
+        continue;
+      }
+      if (space_ && value_) out.push_back(' ');
+      space_ = false;
+      value_ = true;
+      out.push_back(c);
+    }
+  }
+  // Ed25519 signs the SHA-256 of the data, RSA signs the data
+  std::string _sign(const std::string& data) const {
+    unsigned char hash_[EVP_MAX_MD_SIZE];
+    unsigned int hash_size_ = 0;
+    const EVP_MD* md_ = EVP_sha256();
+    const auto* in_ = reinterpret_cast<const unsigned char*>(data.data());
+    size_t in_size_ = data.size();
+    if (EVP_PKEY_get_base_id(_key) == EVP_PKEY_ED25519) {
+      EVP_Digest(data.data(), data.size(), hash_, &hash_size_, md_, nullptr);
+      in_ = hash_;
+      in_size_ = hash_size_;
+      md_ = nullptr;
+    }
+    EVP_MD_CTX* ctx_ = EVP_MD_CTX_new();
+    std::string sig_(static_cast<size_t>(EVP_PKEY_get_size(_key)), '\0');
+    size_t sig_size_ = sig_.size();
+    bool ok_ =
+        ctx_ != nullptr &&
+        EVP_DigestSignInit(ctx_, nullptr, md_, nullptr, _key) == 1 &&
+        EVP_DigestSign(ctx_, reinterpret_cast<unsigned char*>(&sig_[0]),
+                       &sig_size_, in_, in_size_) == 1;
+    EVP_MD_CTX_free(ctx_);
+    if (!ok_) throw std::runtime_error("DKIM signing failed");
+    std::string out_;
+    out_.resize((sig_size_ + 2) / 3 * 4);
+    _base64_scalar(reinterpret_cast<const unsigned char*>(sig_.data()),
+                   sig_size_, &out_[0]);
+    return (out_);
+  }
+};
+// Signers with parsed keys, by selector and domain. A signer is replaced
+// when it is asked for with another key, or its key file changed.
+inline std::shared_ptr<const DkimSigner> dkim_signer(const std::string& domain,
+                                                     const std::string& selector,
+                                                     const std::string& key) {
+  struct Entry {
+    std::string key{};
+    time_t mtime_sec{0};
+    long mtime_nsec{0};
+    off_t size{0};
+    std::shared_ptr<const DkimSigner> signer{};
+  };
+  static std::mutex mtx_{};
+  static std::unordered_map<std::string, Entry> signers_{};
+  std::string id_ = selector + "._domainkey." + domain;
+  struct stat st_ {};
+  if (key.compare(0, 10, "-----BEGIN") != 0 && stat(key.c_str(), &st_) != 0)
+    st_ = {};
+  std::lock_guard<std::mutex> lck_(mtx_);
+  Entry& entry_ = signers_[id_];
+  if (!entry_.signer || entry_.key != key ||
+      entry_.mtime_sec != st_.st_mtim.tv_sec ||
+      entry_.mtime_nsec != st_.st_mtim.tv_nsec || entry_.size != st_.st_size) {
+    try {
+      entry_.signer = std::make_shared<const DkimSigner>(domain, selector, key);
+    } catch (...) {
+      signers_.erase(id_);
+      throw;
+    }
+    entry_.key = key;
+    entry_.mtime_sec = st_.st_mtim.tv_sec;
+    entry_.mtime_nsec = st_.st_mtim.tv_nsec;
+    entry_.size = st_.st_size;
+  }
+  return (entry_.signer);
+}
+inline dkim::dkim(const char* domain, const char* selector, const char* key)
+    : signer(dkim_signer(domain, selector, key)) {}
+// Text with {{field}} placeholders. It is split into segments once, and a
+// personalized copy is sent segment by segment without being built.
+class MergeText {
+ public:
+  MergeText() = default;
+  MergeText(std::string text, const std::vector<std::string>& fields)
+      : _text(std::move(text)) {
+    size_t pos_ = 0;
+    while (pos_ < _text.size()) {
+      size_t open_ = _text.find("{{", pos_);
+      size_t close_ = open_ == std::string::npos ? std::string::npos
+                                                  : _text.find("}}", open_);
+      size_t field_ = fields.size();
+      if (close_ != std::string::npos) {
+        size_t first_ = _text.find_first_not_of(' ', open_ + 2);
+        size_t last_ = _text.find_last_not_of(' ', close_ - 1);
+        for (field_ = 0; field_ < fields.size(); ++field_)
+          if (first_ <= last_ && first_ < close_ &&
+              _text.compare(first_, last_ - first_ + 1, fields[field_]) == 0)
+            break;
+      }
+      if (field_ == fields.size()) {  // No more known placeholders
+        size_t end_ = close_ == std::string::npos ? _text.size() : close_ + 2;
+        _add_literal(pos_, end_ - pos_);
+        pos_ = end_;
+        continue;
+      }
+      _add_literal(pos_, open_ - pos_);
+      _segments.push_back({0, 0, field_});
+      pos_ = close_ + 2;
+    }
+    _needs_encoding = needs_transfer_encoding(_text);
+  }
+  bool empty() const noexcept { return (_text.empty()); }
+  // Whether the personalized text can't be sent as 7bit. Lines are
+  // checked in the template and in each value.
+  bool needs_encoding(const std::vector<std::string>& values) const noexcept {
+    if (_needs_encoding) return (true);
+    for (const auto& seg : _segments)
+      if (seg.field != npos && needs_transfer_encoding(_value(values, seg)))
+        return (true);
+    return (false);
+  }
+  // Size of the personalized text
+  size_t size(const std::vector<std::string>& values) const noexcept {
+    size_t size_ = 0;
+    for (const auto& seg : _segments)
+      size_ += seg.field == npos ? seg.length : _value(values, seg).size();
+    return (size_);
+  }
+  void render(const std::vector<std::string>& values, std::string& out) const {
+    out.clear();
+    out.reserve(size(values));
+    for (const auto& seg : _segments) {
+      if (seg.field == npos)
+        out.append(_text, seg.offset, seg.length);
+      else
+        out.append(_value(values, seg));
+    }
+  }
+  // Reference the personalized text in a message
+  void write(const std::vector<std::string>& values,
+             MessageWriter& writer) const {
+    for (const auto& seg : _segments)
+      writer.reference(seg.field == npos
+                           ? std::string_view(_text).substr(seg.offset,
+                                                            seg.length)
+                           : std::string_view(_value(values, seg)));
+  }
+
+ private:
+  static constexpr size_t npos = static_cast<size_t>(-1);
+  // Literal text of _text, or a field value
+  struct Segment {
+    size_t offset;
+    size_t length;
+    size_t field;
+  };
+  std::string _text{};
+  std::vector<Segment> _segments{};
+  bool _needs_encoding{false};
+
+  void _add_literal(size_t offset, size_t length) {
+    if (length != 0) _segments.push_back({offset, length, npos});
+  }
+  static const std::string& _value(const std::vector<std::string>& values,
+                                   const Segment& seg) noexcept {
+    static const std::string empty_{};
+    return (seg.field < values.size() ? values[seg.field] : empty_);
+  }
+};
+// Subject, text and HTML for a mail-merge. Shared by all recipients.
+class MergeTemplate {
+ public:
+  MergeTemplate() = delete;
+  MergeTemplate(std::vector<std::string> fields, std::string subj,
+                std::string text, std::string html = std::string())
+      : _fields(std::move(fields)),
+        _subject(std::move(subj), _fields),
+        _text(std::move(text), _fields),
+        _html(std::move(html), _fields) {}
+  const std::vector<std::string>& fields() const noexcept { return (_fields); }
+
+ private:
+  friend Request;
+  friend LibCurlWrapperEmail;
+  std::vector<std::string> _fields;
+  MergeText _subject;
+  MergeText _text;
+  MergeText _html;
+};
+// Base64 encoded files, shared by all emails which attach them. A file is
+// read and encoded once, until its mtime or size changes.
+// The least recently used files are evicted over the byte budget.
+class AttachmentCache {
+ public:
+  struct Stats {
+    size_t hits{0};
+    size_t misses{0};
+    size_t files{0};
+    size_t bytes{0};
+  };
+  // Returns nullptr if the file can't be read
+  std::shared_ptr<const std::string> get(const std::string& path) {
+    // The size and mtime of the file which is read, not of the path
+    int fd_ = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd_ < 0) return (nullptr);
+    struct stat st_ {};
+    if (fstat(fd_, &st_) != 0) {
+      close(fd_);
+      return (nullptr);
+    }
+    {
+      std::lock_guard<std::mutex> lck_(_mtx);
+      auto it_ = _index.find(path);
+      if (it_ != _index.end()) {
+        Entry& entry_ = *it_->second;
+        if (entry_.mtime_sec == st_.st_mtim.tv_sec &&
+            entry_.mtime_nsec == st_.st_mtim.tv_nsec &&
+            entry_.size == st_.st_size) {
+          _lru.splice(_lru.begin(), _lru, it_->second);
+          _hits++;
+          close(fd_);
+          return (entry_.data);
+        }
+        _bytes -= entry_.data->size();
+        _lru.erase(it_->second);
+        _index.erase(it_);
+      }
+      _misses++;
+    }
+    auto data_ = std::make_shared<std::string>();
+    bool whole_ = _encode(fd_, st_, *data_);
+    close(fd_);
+    if (!whole_) return (nullptr);
+    std::lock_guard<std::mutex> lck_(_mtx);
+    if (_index.count(path) == 0) {
+      _lru.push_front(Entry{path, st_.st_mtim.tv_sec, st_.st_mtim.tv_nsec,
+                            st_.st_size, data_});
+      _index.emplace(path, _lru.begin());
+      _bytes += data_->size();
+      _evict();
+    }
+    return (data_);
+  }
+  void set_budget(size_t bytes) {
+    std::lock_guard<std::mutex> lck_(_mtx);
+    _budget = bytes;
+    _evict();
+  }
+  Stats stats() {
+    std::lock_guard<std::mutex> lck_(_mtx);
+    return (Stats{_hits, _misses, _lru.size(), _bytes});
+  }
+
+ private:
+  struct Entry {
+    std::string path;
+    time_t mtime_sec;
+    long mtime_nsec;
+    off_t size;
+    std::shared_ptr<const std::string> data;
+  };
+  std::mutex _mtx{};
+  // The most recently used first
+  std::list<Entry> _lru{};
+  std::unordered_map<std::string, std::list<Entry>::iterator> _index{};
+  size_t _bytes{0};
+  size_t _budget{64 * 1024 * 1024};
+  size_t _hits{0};
+  size_t _misses{0};
+
+  // Files in use stay alive until their emails are sent
+  void _evict() {
+    while (_bytes > _budget && !_lru.empty()) {
+      _bytes -= _lru.back().data->size();
+      _index.erase(_lru.back().path);
+      _lru.pop_back();
+    }
+  }
+  // Reads with read() rather than mmap(), so that a file truncated while
+  // it is encoded can't fault. False if it wasn't read as it was at st.
+  static bool _encode(int fd, const struct stat& st, std::string& out) {
+    out.reserve((static_cast<size_t>(st.st_size) + 56) / 57 * 78);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    // Whole lines of 57 bytes, so that chunks join with a line break
+    std::vector<char> buf_(57 * 1024);
+    off_t read_ = 0;
+    while (true) {
+      size_t size_ = 0;
+      while (size_ < buf_.size()) {
+        ssize_t n_ = read(fd, buf_.data() + size_, buf_.size() - size_);
+        if (n_ < 0 && errno == EINTR) continue;
+        if (n_ < 0) return (false);
+        if (n_ == 0) break;
+        size_ += static_cast<size_t>(n_);
+      }
+      if (size_ == 0) break;
+      if (!out.empty()) out.append("\r\n");
+      base64_encode(buf_.data(), size_, out);
+      read_ += static_cast<off_t>(size_);
+      if (size_ < buf_.size()) break;
+    }
+    struct stat now_ {};
+    return (read_ == st.st_size && fstat(fd, &now_) == 0 &&
+            now_.st_size == st.st_size &&
+            now_.st_mtim.tv_sec == st.st_mtim.tv_sec &&
+            now_.st_mtim.tv_nsec == st.st_mtim.tv_nsec);
+  }
+};
+inline AttachmentCache& attachment_cache() {
+  static AttachmentCache cache_{};
+  return (cache_);
+}
+// Message built and encoded once, then sent to many recipients. It is
+// immutable and can be shared between threads. Only Date, To and
+// Message-ID headers are generated for each send.
+class PreparedMessage {
+ public:
+  PreparedMessage() = delete;
+  // Throws std::runtime_error if a file can't be read
+  PreparedMessage(const std::string& from_name, const std::string& from_email,
+                  const std::string& subj, const std::string& text,
+                  const std::string& html = std::string(),
+                  const std::vector<std::string>& filenames = {})
+      : _from(from_name, from_email), _subject(subj) {
+    MimeBoundary mixed_{};
+    MimeBoundary alt_{};
+    MessageWriter writer_{};
+    writer_.reserve(1024);
+    std::string& head_ = writer_.buffer();
+    head_.append("From: ");
+    if (!from_name.empty()) {
+      encode_header(from_name, head_);
+      head_.push_back(' ');
+    }
+    head_.append(from_email);
+    head_.append("\r\nSubject: ");
+    encode_header(subj, head_);
+    head_.append("\r\n");
+    writer_.begin_multipart(mixed_, alt_);
+    _body = head_.find("\r\n\r\n") + 4;
+    // Order "mimetype" is important.
+    std::string encoded_text_;
+    std::string encoded_html_;
+    writer_.text(alt_, "text/plain", text, encoded_text_);
+    writer_.text(alt_, "text/html", html, encoded_html_);
+    writer_.end_multipart(alt_);
+    std::vector<std::shared_ptr<const std::string>> files_;
+    for (const auto& filename : filenames) {
+      files_.push_back(attachment_cache().get(filename));
+      if (!files_.back())
+        throw std::runtime_error("Can't read file " + filename);
+      writer_.attachment(mixed_, filename, *files_.back());
+    }
+    writer_.end_multipart(mixed_);
+    writer_.flatten(_data);
+  }
+  const std::pair<std::string, std::string>& from_address() const noexcept {
+    return (_from);
+  }
+  const std::string& subject() const noexcept { return (_subject); }
+  // From, Subject, MIME headers and the encoded body
+  const std::string& data() const noexcept { return (_data); }
+  std::string_view headers() const noexcept {
+    return (std::string_view(_data).substr(0, _body));
+  }
+  // bh= of the body for DKIM, computed once
+  const std::string& dkim_body_hash() const {
+    std::call_once(_body_hash_once, [this]() {
+      _body_hash = dkim_hash_body(std::string_view(_data).substr(_body));
+    });
+    return (_body_hash);
+  }
+
+ private:
+  std::pair<std::string, std::string> _from{};
+  std::string _subject{};
+  std::string _data{};
+  // Start of the body in _data
+  size_t _body{0};
+  mutable std::once_flag _body_hash_once{};
+  mutable std::string _body_hash{};
+};
+// Whether a failed send may succeed later: 4xx replies and network
+// errors. 5xx replies and other errors are permanent.
+inline bool is_transient(CURLcode res, long response_code) noexcept {
+  if (res == CURLE_OK || response_code >= 500) return (false);
+  if (response_code >= 400) return (true);
+  switch (res) {
+    case CURLE_COULDNT_RESOLVE_HOST:
+    case CURLE_COULDNT_CONNECT:
+    case CURLE_OPERATION_TIMEDOUT:
+    case CURLE_SSL_CONNECT_ERROR:
+    case CURLE_SEND_ERROR:
+    case CURLE_RECV_ERROR:
+    case CURLE_GOT_NOTHING:
+    case CURLE_AGAIN:
+      return (true);
+    default:
+      return (false);
+  }
+}
+
+// One recipient of a mail-merge
+struct MergeRecord {
+  std::string name{};
+  std::string email{};
+  // Values in the order of MergeTemplate::fields()
+  std::vector<std::string> values{};
+};
+
 struct Request {
   std::string error{};
   void* user_data{nullptr};
+  // Last SMTP reply code
+  long response_code{0};
+  // Async retries after transient failures
+  unsigned retries{0};
+  // When the async transfer finished, to measure the callback delay
+  std::chrono::steady_clock::time_point finished{};
 
   Request() = default;
   Request& operator=(const Request&) = default;
@@ -91,15 +1427,47 @@ struct Request {
   Request(Request&&) = default;
   ~Request() {
     if (recipients != nullptr) curl_slist_free_all(recipients);
-    if (headers != nullptr) curl_slist_free_all(headers);
-    if (mime != nullptr) curl_mime_free(mime);
+  }
+  // The serialized message, in order. Valid until the callback returns.
+  const std::vector<std::string_view>& message() const noexcept {
+    return (upload);
+  }
+  size_t message_size() const noexcept { return (writer.size()); }
+  bool transient() const noexcept {
+    return (is_transient(result, response_code));
   }
 
  private:
   friend KeepAliveServers;
   friend LibCurlWrapperEmail;
+  friend RequestPool;
+  friend Message;
+  friend CompletionQueue;
+  friend Spool;
+  friend Metrics;
   CURL* curl{nullptr};
-  std::packaged_task<void(Request&)> cb{[](Request& req) {}};
+  // Connection pool of the checked out handle
+  ServerData* server_data{nullptr};
+  // Key of the keep-alive connection, see make_key()
+  uint64_t key{0};
+  // Link in the submission queue of a worker
+  Request* next{nullptr};
+  // Bytes counted against the async queue limit
+  size_t queued_bytes{0};
+  // The retry of a transfer whose connection may be dead
+  bool fresh_connect{false};
+  std::packaged_task<void(Request&)> cb{};
+  // Callback set as a function pointer, can be copied to other requests
+  void (*cb_ptr)(Request&){nullptr};
+  // Resumes an awaiting coroutine, called after the callback
+  void (*notify)(Request&, void*){nullptr};
+  void* notify_ctx{nullptr};
+  priority lane{priority::normal};
+  // Record of the request in the spool, 0 if it isn't journaled
+  uint64_t spool_id{0};
+  // Async timings
+  std::chrono::steady_clock::time_point submitted{};
+  std::chrono::steady_clock::time_point started{};
 
   long verbose{0};
 
@@ -109,23 +1477,91 @@ struct Request {
   std::vector<std::string> filenames{};
   std::pair<std::string, std::string> from_address{};
   std::string smtp_server{};  // SMTP server
-  std::string sendtext{};
-  std::string sendhtml{};
+  Body sendtext{};
+  Body sendhtml{};
   std::string username{};
   std::string password{};
   std::string email_subject{};
 
   struct curl_slist* recipients{nullptr};
-  struct curl_slist* headers{nullptr};
-  struct curl_slist* headers2{nullptr};
 
-  curl_mime* alt{nullptr};
-  curl_mime* mime{nullptr};  // HTML part
-  curl_mimepart* mimepart{nullptr};
+  // Mail-merge template and values of this recipient
+  std::shared_ptr<const MergeTemplate> merge_template{};
+  std::vector<std::string> merge_values{};
+  // Quoted-printable text and HTML, if they aren't 7bit
+  std::string encoded_text{};
+  std::string encoded_html{};
+  // Encoded files from the attachment cache
+  std::vector<std::shared_ptr<const std::string>> attachments{};
+
+  // Prepared message, referenced after the generated headers
+  std::shared_ptr<const PreparedMessage> prepared_message{};
+  std::shared_ptr<const DkimSigner> signer{};
+  // The message is uploaded with CURLOPT_READFUNCTION from its segments
+  MessageWriter writer{};
+  // Message serialized for the spool, sent instead of a new one
+  std::string spooled{};
+  std::vector<std::string_view> upload{};
+  size_t upload_segment{0};
+  size_t upload_offset{0};
 
+  // Key of the keep-alive connection: hash of server, username and
+  // password. Keys may collide, pools are matched by server and user.
+  void make_key() noexcept {
+    uint64_t key_ = std::hash<std::string>{}(smtp_server);
+    for (const auto* str : {&username, &password})
+      key_ ^= std::hash<std::string>{}(*str) + 0x9e3779b97f4a7c15ULL +
+              (key_ << 6) + (key_ >> 2);
+    key = key_;
+  }
+  // Approximate memory held by the request
+  size_t size_bytes() const noexcept {
+    size_t size_ = sizeof(Request) + from_address.first.capacity() +
+                   from_address.second.capacity() + smtp_server.capacity() +
+                   _owned_bytes(sendtext) + _owned_bytes(sendhtml) +
+                   username.capacity() + password.capacity() +
+                   email_subject.capacity() + spooled.capacity();
+    for (const auto& to_address : to_addresses)
+      size_ += sizeof(to_address) + to_address.first.capacity() +
+               to_address.second.capacity();
+    for (const auto& filename : filenames)
+      size_ += sizeof(filename) + filename.capacity();
+    for (const auto& value : merge_values)
+      size_ += sizeof(value) + value.capacity();
+    // A prepared message is shared and isn't counted
+    return (size_);
+  }
+  // Bodies shared with other requests or owned by the caller aren't counted
+  static size_t _owned_bytes(const Body& body) noexcept {
+    return (body.owner && body.owner.use_count() == 1 ? body.owner->capacity()
+                                                      : 0);
+  }
+  // Copy server, user, sender, files and options of a prototype request
+  void copy_envelope(const Request& proto) {
+    user_data = proto.user_data;
+    cb_ptr = proto.cb_ptr;
+    verbose = proto.verbose;
+    lane = proto.lane;
+    filenames = proto.filenames;
+    from_address = proto.from_address;
+    smtp_server = proto.smtp_server;
+    username = proto.username;
+    password = proto.password;
+    email_subject = proto.email_subject;
+    signer = proto.signer;
+  }
+  bool has_text() const noexcept {
+    return (!sendtext.empty() ||
+            (merge_template && !merge_template->_text.empty()));
+  }
+  bool has_html() const noexcept {
+    return (!sendhtml.empty() ||
+            (merge_template && !merge_template->_html.empty()));
+  }
   bool is_data_valid() {
-    if (sendtext.empty() && sendhtml.empty()) {
-      error.assign("No message for body!");
+    if (prepared_message || !spooled.empty()) return (true);
+    if (!has_text() && !has_html()) {
+      fail(CURLE_BAD_FUNCTION_ARGUMENT, "No message for body!");
       return (false);
     }
     return (true);
@@ -146,386 +1582,2996 @@ struct Request {
   void set_options() {
     curl_easy_setopt(curl, CURLOPT_PRIVATE, user_data);
     curl_easy_setopt(curl, CURLOPT_MAIL_FROM, from_address.second.c_str());
+    if (recipients != nullptr) curl_slist_free_all(recipients);
+    recipients = nullptr;
     for (const auto& to_address : to_addresses)
       recipients = curl_slist_append(recipients, to_address.second.c_str());
     curl_easy_setopt(curl, CURLOPT_MAIL_RCPT, recipients);
     curl_easy_setopt(curl, CURLOPT_VERBOSE, verbose);
+    curl_easy_setopt(curl, CURLOPT_FRESH_CONNECT, fresh_connect ? 1L : 0L);
   }
+  // Headers are formatted straight into the buffer of the writer
   void build_headers() {
-    static std::mt19937_64 random64(time(nullptr));
-    char buffer[1024];
-    time_t tt_ = time(nullptr);
-    struct tm* timeinfo_ = localtime(&tt_);
-    memset(buffer, 0, 1024);
-    strftime(buffer, 79, "Date: %a, %e %b %Y %T %z", timeinfo_);
-    headers = curl_slist_append(headers, buffer);
-
-    std::string header_;
-    header_.reserve(256);
-
-    header_ = "From: ";
-    if (!from_address.first.empty()) {
-      header_.append(from_address.first);
-      header_.push_back(' ');
-    }
-    header_.append(from_address.second);
-    headers = curl_slist_append(headers, header_.c_str());
-
-    header_ = "To: ";
+    std::string& out_ = writer.buffer();
+    out_.append(date_header());
+    out_.append("\r\n");
+
+    // A prepared message has its own From and Subject
+    if (!prepared_message) {
+      out_.append("From: ");
+      if (!from_address.first.empty()) {
+        encode_header(from_address.first, out_);
+        out_.push_back(' ');
+      }
+      out_.append(from_address.second);
+      out_.append("\r\n");
+    }
+
+    out_.append("To: ");
     bool need_sep_ = false;
     for (const auto& to_address : to_addresses) {
-      if (need_sep_) header_.append(", ");
+      if (need_sep_) out_.append(", ");
       if (!to_address.first.empty()) {
-        header_.append(to_address.first);
-        header_.push_back(' ');
+        encode_header(to_address.first, out_);
+        out_.push_back(' ');
       }
-      header_.append(to_address.second);
+      out_.append(to_address.second);
       need_sep_ = true;
     }
-    headers = curl_slist_append(headers, header_.c_str());
-
-    header_ = "Message-ID: <";
-    uint64_t random_message_id_[2] = {random64(), random64()};
-    const char* in_ = reinterpret_cast<const char*>(random_message_id_);
-    const char* hex_char = "0123456789abcdef";
-    unsigned char buf;
-    unsigned char mask = 0x0F;
-    for (int i = 0; i < 16; i++) {
-      if (i == 4) header_.push_back('-');
-      if (i == 6) header_.push_back('-');
-      if (i == 8) header_.push_back('-');
-      if (i == 10) header_.push_back('-');
-      buf = *in_;
-      buf >>= 4;
-      buf &= mask;
-      header_.push_back(hex_char[buf]);
-      buf = *in_++;
-      buf &= mask;
-      header_.push_back(hex_char[buf]);
-    }
-    std::string domain_("@example.org");
-    std::string::size_type pos_ = from_address.second.find("@");
-    if (pos_ != std::string::npos) {
-      domain_.clear();
-      for (auto it_ = from_address.second.cbegin() + pos_;
-           it_ != from_address.second.cend(); ++it_) {
-        if (*it_ == '>') break;
-        if (isspace(*it_)) break;
-        domain_.push_back(*it_);
-      }
-    }
-    header_.append(domain_);
-    header_.push_back('>');
-    headers = curl_slist_append(headers, header_.c_str());
-
-    header_ = "Subject: ";
-    header_.append(email_subject);
-    headers = curl_slist_append(headers, header_.c_str());
-
-    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-  }
-  void build_body() {
-    mime = curl_mime_init(curl);
-    alt = curl_mime_init(curl);
+    out_.append("\r\n");
 
-    // Order "mimetype" is important.
-    if (!sendtext.empty()) {
-      mimepart = curl_mime_addpart(alt);
-      curl_mime_data(mimepart, sendtext.c_str(), CURL_ZERO_TERMINATED);
-      curl_mime_type(mimepart, "text/plain");
+    // 8-4-4-4-12 hex digits, then the domain of the sender
+    static const char* hex_ = "0123456789abcdef";
+    uint64_t random_[2] = {fast_random(), fast_random()};
+    char id_[36];
+    for (size_t i = 0, digit = 0; i < sizeof(id_); ++i) {
+      if (i == 8 || i == 13 || i == 18 || i == 23) {
+        id_[i] = '-';
+        continue;
+      }
+      id_[i] = hex_[(random_[digit / 16] >> (60 - 4 * (digit % 16))) & 0x0F];
+      digit++;
     }
-    if (!sendhtml.empty()) {
-      mimepart = curl_mime_addpart(alt);
-      curl_mime_data(mimepart, sendhtml.c_str(), CURL_ZERO_TERMINATED);
-      curl_mime_type(mimepart, "text/html");
+    out_.append("Message-ID: <");
+    out_.append(id_, sizeof(id_));
+    std::string_view domain_("@example.org");
+    std::string_view sender_(from_address.second);
+    size_t pos_ = sender_.find('@');
+    if (pos_ != std::string_view::npos) {
+      domain_ = sender_.substr(pos_);
+      size_t end_ = domain_.find_first_of("> \t\r\n");
+      if (end_ != std::string_view::npos) domain_ = domain_.substr(0, end_);
     }
-    mimepart = curl_mime_addpart(mime);
-    curl_mime_subparts(mimepart, alt);
-    curl_mime_type(mimepart, "multipart/alternative");
-
-    // You do not need to call curl_slist_free_all for headers2
-    headers2 = curl_slist_append(nullptr, "Content-Disposition: inline");
-    curl_mime_headers(mimepart, headers2, 1);
+    out_.append(domain_);
+    out_.append(">\r\n");
+    if (prepared_message) return;
 
+    out_.append("Subject: ");
+    encode_header(email_subject, out_);
+    out_.append("\r\n");
+  }
+  void build_body() {
+    if (prepared_message) {
+      writer.reference(prepared_message->data());
+      return;
+    }
+    MimeBoundary mixed_{};
+    MimeBoundary alt_{};
+    writer.begin_multipart(mixed_, alt_);
+    // Order "mimetype" is important.
+    if (has_text())
+      add_text(alt_, "text/plain", sendtext,
+               merge_template ? &merge_template->_text : nullptr,
+               encoded_text);
+    if (has_html())
+      add_text(alt_, "text/html", sendhtml,
+               merge_template ? &merge_template->_html : nullptr,
+               encoded_html);
+    writer.end_multipart(alt_);
+    attachments.clear();
     for (const auto& filename : filenames) {
-      mimepart = curl_mime_addpart(mime);
-      curl_mime_filedata(mimepart, filename.c_str());
+      attachments.push_back(attachment_cache().get(filename));
+      if (!attachments.back())
+        throw std::runtime_error("Can't read file " + filename);
+      writer.attachment(mixed_, filename, *attachments.back());
     }
-
-    curl_easy_setopt(curl, CURLOPT_MIMEPOST, mime);
+    writer.end_multipart(mixed_);
+  }
+  // A mail-merge text is referenced from the template and the values of
+  // this recipient, without building a personalized copy, unless it has
+  // to be encoded.
+  void add_text(std::string_view boundary, const char* type,
+                const Body& data, const MergeText* tmpl,
+                std::string& encoded) {
+    if (tmpl == nullptr || tmpl->empty()) {
+      writer.text(boundary, type, data.view, encoded);
+      return;
+    }
+    encoded.clear();
+    if (!tmpl->needs_encoding(merge_values)) {
+      writer.begin_text(boundary, type, false);
+      tmpl->write(merge_values, writer);
+      writer.end_part();
+      return;
+    }
+    std::string text_;
+    tmpl->render(merge_values, text_);
+    quoted_printable_encode(text_.data(), text_.size(), encoded);
+    writer.begin_text(boundary, type, true);
+    writer.reference(encoded);
+    writer.end_part();
+  }
+  // Add DKIM-Signature. The body hash of a prepared message is reused.
+  void sign() {
+    std::string_view buffer_ = writer.buffer();
+    std::vector<std::string_view> headers_{};
+    if (prepared_message) {
+      headers_.push_back(buffer_);
+      headers_.push_back(prepared_message->headers());
+      writer.prepend(signer->sign(
+          headers_, prepared_message->dkim_body_hash(), time(nullptr)));
+      return;
+    }
+    // Generated headers end before the first referenced body
+    size_t skip_ = buffer_.find("\r\n\r\n") + 4;
+    headers_.push_back(buffer_.substr(0, skip_));
+    writer.segments(upload);
+    DkimBodyHash hash_{};
+    for (auto seg : upload) {
+      if (skip_ >= seg.size()) {
+        skip_ -= seg.size();
+        continue;
+      }
+      hash_.update(seg.substr(skip_));
+      skip_ = 0;
+    }
+    writer.prepend(signer->sign(headers_, hash_.finish(), time(nullptr)));
+  }
+  // Serialize headers and body into the writer
+  void compose() {
+    writer.clear();
+    if (!spooled.empty()) {
+      writer.reference(spooled);
+      return;
+    }
+    size_t head_ = 1024 + email_subject.size() + from_address.first.size() +
+                   256 * filenames.size();
+    for (const auto& to_address : to_addresses)
+      head_ += to_address.first.size() + to_address.second.size() + 2;
+    writer.reserve(head_);
+    build_headers();
+    build_body();
+    if (signer) sign();
+  }
+  // Serialize the message once for the spool. Its parts aren't needed
+  // anymore.
+  void freeze() {
+    compose();
+    writer.flatten(spooled);
+    writer.clear();
+    sendtext = Body();
+    sendhtml = Body();
+    merge_template.reset();
+    merge_values.clear();
+    attachments.clear();
+    prepared_message.reset();
+    signer.reset();
+  }
+  // Upload the serialized message. A retry sends the message of the first
+  // attempt, so its Date and Message-ID stay the same.
+  void build_message() {
+    if (writer.size() == 0) compose();
+    writer.segments(upload);
+    upload_segment = 0;
+    upload_offset = 0;
+    curl_easy_setopt(curl, CURLOPT_UPLOAD, 1L);
+    curl_easy_setopt(curl, CURLOPT_INFILESIZE_LARGE,
+                     static_cast<curl_off_t>(writer.size()));
+    curl_easy_setopt(curl, CURLOPT_READFUNCTION, Request::_upload_read);
+    curl_easy_setopt(curl, CURLOPT_READDATA, this);
+    curl_easy_setopt(curl, CURLOPT_SEEKFUNCTION, Request::_upload_seek);
+    curl_easy_setopt(curl, CURLOPT_SEEKDATA, this);
+  }
+  static size_t _upload_read(char* buffer, size_t size, size_t nitems,
+                             void* arg) {
+    auto* req_ = static_cast<Request*>(arg);
+    size_t n_ = size * nitems;
+    size_t copied_ = 0;
+    while (copied_ < n_ && req_->upload_segment < req_->upload.size()) {
+      const auto& seg_ = req_->upload[req_->upload_segment];
+      size_t chunk_ = std::min(n_ - copied_, seg_.size() - req_->upload_offset);
+      memcpy(buffer + copied_, seg_.data() + req_->upload_offset, chunk_);
+      copied_ += chunk_;
+      req_->upload_offset += chunk_;
+      if (req_->upload_offset == seg_.size()) {
+        req_->upload_segment++;
+        req_->upload_offset = 0;
+      }
+    }
+    return (copied_);
+  }
+  static int _upload_seek(void* arg, curl_off_t offset, int origin) {
+    auto* req_ = static_cast<Request*>(arg);
+    if (origin != SEEK_SET || offset < 0) return (CURL_SEEKFUNC_CANTSEEK);
+    auto left_ = static_cast<size_t>(offset);
+    for (req_->upload_segment = 0; req_->upload_segment < req_->upload.size();
+         req_->upload_segment++) {
+      size_t seg_size_ = req_->upload[req_->upload_segment].size();
+      if (left_ < seg_size_) break;
+      left_ -= seg_size_;
+    }
+    if (req_->upload_segment == req_->upload.size() && left_ != 0)
+      return (CURL_SEEKFUNC_FAIL);
+    req_->upload_offset = left_;
+    return (CURL_SEEKFUNC_OK);
   }
   // Send email
-  void perform() {
-    CURLcode res = curl_easy_perform(curl);
+  void perform() { done(curl_easy_perform(curl)); }
+  // End without a transfer, with an error
+  void fail(CURLcode res, const char* what) {
+    result = res;
+    error.assign(what);
+  }
+  // Store result of a finished transfer
+  void done(CURLcode res) {
+    result = res;
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
     if (res != CURLE_OK) error.assign(curl_easy_strerror(res));
   }
-  void callback() { cb(*this); }
+  void callback() {
+    if (cb.valid())
+      cb(*this);
+    else if (cb_ptr != nullptr)
+      cb_ptr(*this);
+    if (notify != nullptr) notify(*this, notify_ctx);
+  }
+  // Clear for reuse. Strings and vectors keep their capacity, unless it
+  // is over max_capacity bytes.
+  void recycle(size_t max_capacity) noexcept {
+    error.clear();
+    user_data = nullptr;
+    response_code = 0;
+    retries = 0;
+    finished = {};
+    submitted = {};
+    started = {};
+    notify = nullptr;
+    notify_ctx = nullptr;
+    lane = priority::normal;
+    spool_id = 0;
+    curl = nullptr;
+    server_data = nullptr;
+    key = 0;
+    next = nullptr;
+    queued_bytes = 0;
+    fresh_connect = false;
+    cb = std::packaged_task<void(Request&)>();
+    cb_ptr = nullptr;
+    verbose = 0;
+    result = CURLE_OK;
+    to_addresses.clear();
+    filenames.clear();
+    from_address.first.clear();
+    from_address.second.clear();
+    smtp_server.clear();
+    sendtext = Body();
+    sendhtml = Body();
+    username.clear();
+    password.clear();
+    email_subject.clear();
+    if (recipients != nullptr) curl_slist_free_all(recipients);
+    recipients = nullptr;
+    merge_template.reset();
+    merge_values.clear();
+    attachments.clear();
+    prepared_message.reset();
+    signer.reset();
+    upload.clear();
+    upload_segment = 0;
+    upload_offset = 0;
+    for (auto* str : {&encoded_text, &encoded_html, &spooled}) {
+      str->clear();
+      if (str->capacity() > max_capacity) std::string().swap(*str);
+    }
+    writer.clear();
+    writer.trim(max_capacity);
+  }
 };
-// For keep-alive connections
-class KeepAliveServers {
+// Requests for reuse. Each thread keeps a few of them, the others are
+// shared. A request is usually created by a sender thread and released by
+// a worker, so they move between threads in batches.
+class RequestPool {
  public:
-  void init_and_lock(Request& req) {
-    size_t uhash = std::hash<std::string>{}(req.username);
-    size_t phash = std::hash<std::string>{}(req.password);
-    std::unique_lock<std::mutex> lck_(_servers_mtx);
-    auto it_ = _servers.find(req.smtp_server);
-    if (it_ != _servers.end()) {
-      auto itlow = _servers.lower_bound(req.smtp_server);
-      auto itup = _servers.upper_bound(req.smtp_server);
-
-      for (it_ = itlow; it_ != itup; ++it_) {
-        if (it_->second->username_hash == uhash &&
-            it_->second->password_hash == phash)
-          break;
-      }
-      if (it_ == itup) it_ = _servers.end();
+  struct Stats {
+    size_t hits{0};
+    size_t misses{0};
+    size_t pooled{0};
+  };
+  RequestPtr acquire() {
+    Cache* cache_ = _cache();
+    if (cache_ != nullptr && cache_->requests.empty()) _refill(*cache_);
+    if (cache_ == nullptr || cache_->requests.empty()) {
+      _misses.fetch_add(1, std::memory_order_relaxed);
+      return (RequestPtr(new Request));
     }
-    if (it_ == _servers.end()) {  // Init new
-      req.init();
-      auto serv = _servers.emplace(req.smtp_server,
-                                   new ServerData(req.curl, uhash, phash));
-      serv->second->mtx.lock();
-    } else {  // Get existing
-      req.curl = it_->second->curl;
-      it_->second->last_connection = time(nullptr);
-      it_->second->mtx.lock();
-    }
-  }
-  void unlock(const Request& req) {
-    std::unique_lock<std::mutex> lck_(_servers_mtx);
-    auto it_ = _servers.find(req.smtp_server);
-    if (it_ != _servers.end()) {
-      size_t uhash = std::hash<std::string>{}(req.username);
-      size_t phash = std::hash<std::string>{}(req.password);
-      auto itlow = _servers.lower_bound(req.smtp_server);
-      auto itup = _servers.upper_bound(req.smtp_server);
-
-      for (it_ = itlow; it_ != itup; ++it_) {
-        if (it_->second->username_hash == uhash &&
-            it_->second->password_hash == phash) {
-          it_->second->last_connection = time(nullptr);
-          it_->second->mtx.unlock();
-          break;
-        }
-      }
+    _hits.fetch_add(1, std::memory_order_relaxed);
+    Request* req_ = cache_->requests.back();
+    cache_->requests.pop_back();
+    return (RequestPtr(req_));
+  }
+  void release(Request* req) noexcept {
+    req->recycle(max_capacity);
+    Cache* cache_ = _cache();
+    if (cache_ == nullptr) {  // The thread is exiting
+      delete req;
+      return;
     }
+    cache_->requests.push_back(req);
+    if (cache_->requests.size() == batch_size) _spill(*cache_);
   }
-  void clear_old() {
-    // Expiries keys will be erased
-    time_t expiries_ = time(nullptr) - 15;
-    std::unique_lock<std::mutex> lck_(_servers_mtx);
-    for (auto it_ = _servers.begin(); it_ != _servers.end();) {
-      if (it_->second->last_connection < expiries_ &&
-          it_->second->mtx.try_lock()) {
-        curl_easy_cleanup(it_->second->curl);
-        it_->second->mtx.unlock();
-        it_ = _servers.erase(it_);
-      } else {
-        it_++;
-      }
+  // Max requests shared between threads
+  void set_limit(size_t n) noexcept {
+    std::lock_guard<std::mutex> lck_(_mtx);
+    _limit = n;
+    while (_shared.size() > _limit) {
+      delete _shared.back();
+      _shared.pop_back();
     }
   }
-  ~KeepAliveServers() {
-    std::unique_lock<std::mutex> lck_(_servers_mtx);
-    for (const auto& serv : _servers) curl_easy_cleanup(serv.second->curl);
+  Stats stats() {
+    std::lock_guard<std::mutex> lck_(_mtx);
+    return (Stats{_hits.load(), _misses.load(), _shared.size()});
+  }
+  ~RequestPool() {
+    for (Request* req : _shared) delete req;
   }
 
  private:
-  struct ServerData {
-    time_t last_connection{time(nullptr)};
-    CURL* curl{nullptr};
-    size_t username_hash;
-    size_t password_hash;
-    std::mutex mtx{};
-
-    ServerData() = delete;
-    ServerData& operator=(const ServerData&) = default;
-    ServerData& operator=(ServerData&&) = default;
-    ServerData(const ServerData&) = default;
-    ServerData(ServerData&&) = default;
-    ServerData(CURL* c, size_t uhash, size_t phash)
-        : curl(c), username_hash(uhash), password_hash(phash) {}
+  static constexpr size_t batch_size = 32;
+  // Larger buffers aren't kept by recycled requests
+  static constexpr size_t max_capacity = 64 * 1024;
+  struct Cache {
+    std::vector<Request*> requests{};
+    RequestPool* pool{nullptr};
+    bool* destroyed{nullptr};
+    ~Cache() {
+      *destroyed = true;
+      std::lock_guard<std::mutex> lck_(pool->_mtx);
+      for (Request* req : requests) {
+        if (pool->_shared.size() < pool->_limit)
+          pool->_shared.push_back(req);
+        else
+          delete req;
+      }
+    }
   };
-  std::mutex _servers_mtx{};
-  std::multimap<std::string, std::unique_ptr<ServerData>> _servers{};
-};
+  std::mutex _mtx{};
+  std::vector<Request*> _shared{};
+  size_t _limit{4096};
+  std::atomic<size_t> _hits{0};
+  std::atomic<size_t> _misses{0};
 
-class LibCurlWrapperEmail {
- public:
-  size_t globalSize() const noexcept { return (globalRequests.size()); }
-  size_t localSize() const noexcept { return (localRequests.size()); }
-  // class control
-  LibCurlWrapperEmail& operator<<(directive d) {
-    if (localRequests.empty()) return (*this);
-    switch (d) {
-      case directive::syncperform:
-        _perform(localRequests);
-        localRequests.clear();
-        break;
-      case directive::asyncperform:
-        mtxRequests.lock();
-        for (auto& r : localRequests) globalRequests.push_back(std::move(r));
-        mtxRequests.unlock();
-        cV.notify_one();
-        localRequests.clear();
-        break;
-      case directive::verbose:
-        localRequests.back()->verbose = 1;
-        break;
-      default:
-        break;
+  // Requests released by thread_local objects may outlive the cache
+  Cache* _cache() {
+    thread_local bool destroyed_ = false;
+    if (destroyed_) return (nullptr);
+    thread_local Cache cache_{};
+    if (cache_.pool == nullptr) {
+      cache_.pool = this;
+      cache_.destroyed = &destroyed_;
+      cache_.requests.reserve(batch_size);
+    }
+    return (&cache_);
+  }
+  void _refill(Cache& cache) {
+    std::lock_guard<std::mutex> lck_(_mtx);
+    size_t n_ = std::min(batch_size, _shared.size());
+    cache.requests.insert(cache.requests.end(), _shared.end() - n_,
+                          _shared.end());
+    _shared.resize(_shared.size() - n_);
+  }
+  // Move the requests of a thread to the shared ones, or delete them over
+  // the limit
+  void _spill(Cache& cache) noexcept {
+    std::lock_guard<std::mutex> lck_(_mtx);
+    for (Request* req : cache.requests) {
+      if (_shared.size() < _limit) {
+        try {
+          _shared.push_back(req);
+          continue;
+        } catch (...) {
+        }
+      }
+      delete req;
+    }
+    cache.requests.clear();
+  }
+};
+inline RequestPool& request_pool() {
+  static RequestPool pool_{};
+  return (pool_);
+}
+inline void RequestRecycler::operator()(Request* req) const noexcept {
+  request_pool().release(req);
+}
+// Latencies in log-linear buckets, four for each power of two of
+// microseconds. A percentile is the upper bound of its bucket, within 25%.
+class LatencyHistogram {
+ public:
+  static constexpr size_t nBuckets = 4 * 40;
+  // Counts copied at one time. Snapshots of several histograms can be
+  // merged.
+  struct Snapshot {
+    std::array<size_t, nBuckets> buckets{};
+    std::chrono::nanoseconds sum{0};
+
+    size_t count() const noexcept {
+      size_t count_ = 0;
+      for (size_t b : buckets) count_ += b;
+      return (count_);
     }
+    // p in [0, 100]. Zero if nothing was recorded.
+    std::chrono::nanoseconds percentile(double p) const noexcept {
+      size_t total_ = count();
+      if (total_ == 0) return (std::chrono::nanoseconds(0));
+      auto rank_ = static_cast<size_t>(p / 100 * static_cast<double>(total_));
+      rank_ = std::min(std::max<size_t>(rank_, 1), total_);
+      size_t seen_ = 0;
+      for (size_t i = 0; i < nBuckets; ++i) {
+        seen_ += buckets[i];
+        if (seen_ >= rank_) return (upper(i));
+      }
+      return (upper(nBuckets - 1));
+    }
+    void merge(const Snapshot& other) noexcept {
+      for (size_t i = 0; i < nBuckets; ++i) buckets[i] += other.buckets[i];
+      sum += other.sum;
+    }
+  };
+  void record(std::chrono::nanoseconds d) noexcept {
+    _buckets[_index(d)].fetch_add(1, std::memory_order_relaxed);
+    _sum.fetch_add(d.count() > 0 ? static_cast<uint64_t>(d.count()) : 0,
+                   std::memory_order_relaxed);
+  }
+  size_t count() const noexcept {
+    size_t count_ = 0;
+    for (const auto& b : _buckets) count_ += b.load(std::memory_order_relaxed);
+    return (count_);
+  }
+  std::chrono::nanoseconds percentile(double p) const noexcept {
+    return (snapshot().percentile(p));
+  }
+  Snapshot snapshot() const noexcept {
+    Snapshot snap_{};
+    for (size_t i = 0; i < nBuckets; ++i)
+      snap_.buckets[i] = _buckets[i].load(std::memory_order_relaxed);
+    snap_.sum = std::chrono::nanoseconds(_sum.load(std::memory_order_relaxed));
+    return (snap_);
+  }
+  // Upper bound of bucket i
+  static std::chrono::nanoseconds upper(size_t i) noexcept {
+    if (i < 4) return (std::chrono::microseconds(i + 1));
+    uint64_t us_ = (5 + i % 4) << (i / 4 - 1);
+    return (std::chrono::microseconds(us_));
+  }
+
+ private:
+  static size_t _index(std::chrono::nanoseconds d) noexcept {
+    uint64_t us_ = d.count() <= 0 ? 0 : static_cast<uint64_t>(d.count()) / 1000;
+    if (us_ < 4) return (us_);
+    size_t log_ = 63 - __builtin_clzll(us_);
+    size_t i_ = (log_ - 1) * 4 + ((us_ >> (log_ - 2)) & 3);
+    return (std::min(i_, nBuckets - 1));
+  }
+  std::array<std::atomic<size_t>, nBuckets> _buckets{};
+  std::atomic<uint64_t> _sum{0};
+};
+// Transfer metrics of one connection key, merged over all threads
+struct ServerMetrics {
+  std::string server{};
+  std::string user{};
+  size_t transfers{0};  // Including retries
+  size_t new_connections{0};
+  size_t reused_connections{0};
+  uint64_t bytes_uploaded{0};
+  // Failed transfers by CURLcode
+  std::map<CURLcode, size_t> errors{};
+  // From submit to the start of an async transfer, retries excluded
+  LatencyHistogram::Snapshot queue_wait{};
+  // Blocked for a free connection or the rate limit, by a sync send
+  LatencyHistogram::Snapshot lock_wait{};
+  // Phases of a new connection
+  LatencyHistogram::Snapshot name_lookup{};
+  LatencyHistogram::Snapshot connect{};
+  LatencyHistogram::Snapshot tls{};
+  LatencyHistogram::Snapshot transfer{};
+};
+struct MetricsSnapshot {
+  std::vector<ServerMetrics> servers{};
+
+  // Prometheus text exposition format. Histogram buckets are powers of 4
+  // microseconds, which are exact bucket bounds of LatencyHistogram.
+  std::string prometheus() const {
+    std::string out_{};
+    auto counter_ = [&](const char* name, const char* help) {
+      out_.append("# HELP ").append(name).append(" ").append(help);
+      out_.append("\n# TYPE ").append(name).append(" counter\n");
+    };
+    auto sample_ = [&](const char* name, const ServerMetrics& m,
+                       const std::string& extra, uint64_t value) {
+      out_.append(name).append("{");
+      _labels(m, out_);
+      out_.append(extra).append("} ").append(std::to_string(value));
+      out_.push_back('\n');
+    };
+    counter_("smtp_transfers_total", "SMTP transfers, including retries.");
+    for (const auto& m : servers)
+      sample_("smtp_transfers_total", m, std::string(), m.transfers);
+    counter_("smtp_connections_total", "Connections used by transfers.");
+    for (const auto& m : servers) {
+      sample_("smtp_connections_total", m, ",reused=\"false\"",
+              m.new_connections);
+      sample_("smtp_connections_total", m, ",reused=\"true\"",
+              m.reused_connections);
+    }
+    counter_("smtp_upload_bytes_total", "Bytes uploaded by transfers.");
+    for (const auto& m : servers)
+      sample_("smtp_upload_bytes_total", m, std::string(), m.bytes_uploaded);
+    counter_("smtp_errors_total", "Failed transfers by CURLcode.");
+    for (const auto& m : servers) {
+      for (const auto& e : m.errors) {
+        std::string extra_ = ",code=\"" + std::to_string(e.first) + "\"";
+        sample_("smtp_errors_total", m, extra_, e.second);
+      }
+    }
+    const std::pair<const char*, LatencyHistogram::Snapshot ServerMetrics::*>
+        histograms_[] = {
+            {"smtp_queue_wait_seconds", &ServerMetrics::queue_wait},
+            {"smtp_lock_wait_seconds", &ServerMetrics::lock_wait},
+            {"smtp_name_lookup_seconds", &ServerMetrics::name_lookup},
+            {"smtp_connect_seconds", &ServerMetrics::connect},
+            {"smtp_tls_seconds", &ServerMetrics::tls},
+            {"smtp_transfer_seconds", &ServerMetrics::transfer}};
+    for (const auto& h : histograms_) {
+      out_.append("# TYPE ").append(h.first).append(" histogram\n");
+      for (const auto& m : servers) _histogram(h.first, m, m.*h.second, out_);
+    }
+    return (out_);
+  }
+
+ private:
+  static void _escape(const std::string& value, std::string& out) {
+    for (char c : value) {
+      if (c == '\\' || c == '"') out.push_back('\\');
+      if (c == '\n') {
+        out.append("\\n");
+        continue;
+      }
+      out.push_back(c);
+    }
+  }
+  static void _labels(const ServerMetrics& m, std::string& out) {
+    out.append("server=\"");
+    _escape(m.server, out);
+    out.append("\",user=\"");
+    _escape(m.user, out);
+    out.push_back('"');
+  }
+  static void _histogram(const char* name, const ServerMetrics& m,
+                         const LatencyHistogram::Snapshot& h,
+                         std::string& out) {
+    char value_[32];
+    size_t seen_ = 0;
+    size_t i = 0;
+    for (uint64_t le_us = 16; le_us <= (uint64_t(1) << 26); le_us *= 4) {
+      for (; i < LatencyHistogram::nBuckets &&
+             LatencyHistogram::upper(i) <= std::chrono::microseconds(le_us);
+           ++i)
+        seen_ += h.buckets[i];
+      snprintf(value_, sizeof(value_), "%.9g",
+               static_cast<double>(le_us) / 1e6);
+      out.append(name).append("_bucket{");
+      _labels(m, out);
+      out.append(",le=\"").append(value_).append("\"} ");
+      out.append(std::to_string(seen_)).push_back('\n');
+    }
+    size_t count_ = h.count();
+    out.append(name).append("_bucket{");
+    _labels(m, out);
+    out.append(",le=\"+Inf\"} ").append(std::to_string(count_)).push_back('\n');
+    snprintf(value_, sizeof(value_), "%.9g",
+             std::chrono::duration<double>(h.sum).count());
+    out.append(name).append("_sum{");
+    _labels(m, out);
+    out.append("} ").append(value_).push_back('\n');
+    out.append(name).append("_count{");
+    _labels(m, out);
+    out.append("} ").append(std::to_string(count_)).push_back('\n');
+  }
+};
+// Transfer metrics by connection key. Each thread records into its own
+// shard with relaxed atomics, and snapshot() merges the shards. The shard
+// of a finished thread is taken over by the next new thread.
+class Metrics {
+ public:
+  // A transfer of req finished and its handle is still valid
+  void transfer(const Request& req) noexcept {
+    Entry* e_ = _entry(req);
+    if (e_ == nullptr) return;
+    e_->transfers.fetch_add(1, std::memory_order_relaxed);
+    if (req.result != CURLE_OK && req.result < CURL_LAST)
+      e_->errors[req.result].fetch_add(1, std::memory_order_relaxed);
+    long connects_ = 0;
+    curl_off_t lookup_ = 0, connect_ = 0, tls_ = 0, total_ = 0, bytes_ = 0;
+    curl_easy_getinfo(req.curl, CURLINFO_NUM_CONNECTS, &connects_);
+    curl_easy_getinfo(req.curl, CURLINFO_TOTAL_TIME_T, &total_);
+    curl_easy_getinfo(req.curl, CURLINFO_SIZE_UPLOAD_T, &bytes_);
+    e_->transfer.record(std::chrono::microseconds(total_));
+    e_->bytes_uploaded.fetch_add(static_cast<uint64_t>(bytes_),
+                                 std::memory_order_relaxed);
+    // A failed connect has neither a new connection nor a reply
+    if (connects_ == 0) {
+      if (req.response_code != 0)
+        e_->reused.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    e_->connections.fetch_add(1, std::memory_order_relaxed);
+    // Times of the phases are cumulative from the start
+    curl_easy_getinfo(req.curl, CURLINFO_NAMELOOKUP_TIME_T, &lookup_);
+    curl_easy_getinfo(req.curl, CURLINFO_CONNECT_TIME_T, &connect_);
+    curl_easy_getinfo(req.curl, CURLINFO_APPCONNECT_TIME_T, &tls_);
+    e_->name_lookup.record(std::chrono::microseconds(lookup_));
+    if (connect_ >= lookup_)
+      e_->connect.record(std::chrono::microseconds(connect_ - lookup_));
+    if (tls_ >= connect_ && tls_ != 0)
+      e_->tls.record(std::chrono::microseconds(tls_ - connect_));
+  }
+  void queue_wait(const Request& req, std::chrono::nanoseconds d) noexcept {
+    if (Entry* e_ = _entry(req)) e_->queue_wait.record(d);
+  }
+  void lock_wait(const Request& req, std::chrono::nanoseconds d) noexcept {
+    if (Entry* e_ = _entry(req)) e_->lock_wait.record(d);
+  }
+  MetricsSnapshot snapshot() const {
+    // By server and user, in the order of the snapshot
+    std::map<std::pair<std::string, std::string>, ServerMetrics> merged_{};
+    std::lock_guard<std::mutex> lck_(_mtx);
+    for (const auto& shard : _shards) {
+      std::lock_guard<std::mutex> shard_lck_(shard->mtx);
+      for (const Entry& e : shard->entries) {
+        ServerMetrics& m_ = merged_[{e.server, e.user}];
+        if (m_.server.empty()) {
+          m_.server = e.server;
+          m_.user = e.user;
+        }
+        m_.transfers += e.transfers.load(std::memory_order_relaxed);
+        m_.new_connections += e.connections.load(std::memory_order_relaxed);
+        m_.reused_connections += e.reused.load(std::memory_order_relaxed);
+        m_.bytes_uploaded += e.bytes_uploaded.load(std::memory_order_relaxed);
+        for (size_t c = 0; c < e.errors.size(); ++c) {
+          size_t n_ = e.errors[c].load(std::memory_order_relaxed);
+          if (n_ != 0) m_.errors[static_cast<CURLcode>(c)] += n_;
+        }
+        m_.queue_wait.merge(e.queue_wait.snapshot());
+        m_.lock_wait.merge(e.lock_wait.snapshot());
+        m_.name_lookup.merge(e.name_lookup.snapshot());
+        m_.connect.merge(e.connect.snapshot());
+        m_.tls.merge(e.tls.snapshot());
+        m_.transfer.merge(e.transfer.snapshot());
+      }
+    }
+    MetricsSnapshot snap_{};
+    snap_.servers.reserve(merged_.size());
+    for (auto& m : merged_) snap_.servers.push_back(std::move(m.second));
+    return (snap_);
+  }
+
+ private:
+  struct Entry {
+    Entry(const std::string& s, const std::string& u) : server(s), user(u) {}
+    const std::string server;
+    const std::string user;
+    std::atomic<size_t> transfers{0};
+    std::atomic<size_t> connections{0};
+    std::atomic<size_t> reused{0};
+    std::atomic<uint64_t> bytes_uploaded{0};
+    std::array<std::atomic<size_t>, CURL_LAST> errors{};
+    LatencyHistogram queue_wait{};
+    LatencyHistogram lock_wait{};
+    LatencyHistogram name_lookup{};
+    LatencyHistogram connect{};
+    LatencyHistogram tls{};
+    LatencyHistogram transfer{};
+  };
+  struct Shard {
+    // Guards entries against snapshot(), taken by the owner only to add
+    std::mutex mtx{};
+    std::deque<Entry> entries{};
+    // Lookup of the owner thread, keys may collide
+    std::unordered_multimap<uint64_t, Entry*> index{};
+  };
+  // Gives the shard back when its thread ends
+  struct Owner {
+    Metrics* metrics{nullptr};
+    Shard* shard{nullptr};
+    ~Owner() {
+      if (shard == nullptr) return;
+      std::lock_guard<std::mutex> lck_(metrics->_mtx);
+      metrics->_free.push_back(shard);
+    }
+  };
+
+  Entry* _entry(const Request& req) noexcept {
+    thread_local Owner owner_{};
+    try {
+      if (owner_.shard == nullptr) {
+        std::lock_guard<std::mutex> lck_(_mtx);
+        if (!_free.empty()) {
+          owner_.shard = _free.back();
+          _free.pop_back();
+        } else {
+          _shards.emplace_back(new Shard);
+          owner_.shard = _shards.back().get();
+        }
+        owner_.metrics = this;
+      }
+      Shard& shard_ = *owner_.shard;
+      auto range_ = shard_.index.equal_range(req.key);
+      for (auto it_ = range_.first; it_ != range_.second; ++it_)
+        if (it_->second->server == req.smtp_server &&
+            it_->second->user == req.username)
+          return (it_->second);
+      std::lock_guard<std::mutex> lck_(shard_.mtx);
+      Entry& e_ = shard_.entries.emplace_back(req.smtp_server, req.username);
+      shard_.index.emplace(req.key, &e_);
+      return (&e_);
+    } catch (const std::exception&) {
+      return (nullptr);
+    }
+  }
+
+  mutable std::mutex _mtx{};
+  std::vector<std::unique_ptr<Shard>> _shards{};
+  // Shards of finished threads
+  std::vector<Shard*> _free{};
+};
+inline Metrics& metrics() {
+  static Metrics metrics_{};
+  return (metrics_);
+}
+// Finished async requests waiting for their callbacks, so a slow
+// callback doesn't hold up the workers. Callbacks run on a pool of
+// threads or on the application's thread in poll().
+class CompletionQueue {
+ public:
+  struct Stats {
+    size_t pending{0};
+    size_t completed{0};
+    // From the end of the transfer to the callback
+    std::chrono::nanoseconds max_delay{0};
+    std::chrono::nanoseconds total_delay{0};
+  };
+  ~CompletionQueue() {
+    stop();
+    if (_fd >= 0) close(_fd);
+  }
+  // Takes effect with the next start()
+  void set_mode(completion mode, size_t threads) noexcept {
+    std::lock_guard<std::mutex> lck_(_mtx);
+    _mode = mode;
+    _nthreads = threads == 0 ? 1 : threads;
+  }
+  completion mode() const noexcept { return (_active); }
+  void start() {
+    std::lock_guard<std::mutex> lck_(_mtx);
+    _stopping = false;
+    _active = _mode;
+    if (_mode != completion::threads || !_threads.empty()) return;
+    for (size_t i = 0; i < _nthreads; ++i)
+      _threads.emplace_back(&CompletionQueue::_serve, this);
+  }
+  // Callback threads finish the queue before they exit. Callbacks which
+  // still wait for poll() run on this thread.
+  void stop() {
+    {
+      std::lock_guard<std::mutex> lck_(_mtx);
+      _stopping = true;
+    }
+    _cv.notify_all();
+    for (auto& t : _threads)
+      if (t.joinable()) t.join();
+    _threads.clear();
+    std::vector<RequestPtr> batch_{};
+    {
+      std::lock_guard<std::mutex> lck_(_mtx);
+      _take(batch_, SIZE_MAX);
+    }
+    _call(batch_);
+  }
+  // Move reqs into the queue
+  void post(std::vector<RequestPtr>& reqs) {
+    if (reqs.empty()) return;
+    {
+      std::lock_guard<std::mutex> lck_(_mtx);
+      if (_queue.empty()) _signal();
+      for (auto& r : reqs) _queue.push_back(std::move(r));
+    }
+    reqs.size() == 1 ? _cv.notify_one() : _cv.notify_all();
+    reqs.clear();
+  }
+  // Eventfd which is readable while the queue isn't empty
+  int fd() {
+    std::lock_guard<std::mutex> lck_(_mtx);
+    if (_fd < 0) {
+      _fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+      if (!_queue.empty()) _signal();
+    }
+    return (_fd);
+  }
+  // Run up to max callbacks on this thread. Returns how many were run.
+  size_t poll(size_t max) {
+    std::vector<RequestPtr> batch_{};
+    {
+      std::lock_guard<std::mutex> lck_(_mtx);
+      _take(batch_, max);
+    }
+    size_t n_ = batch_.size();
+    _call(batch_);
+    return (n_);
+  }
+  Stats stats() {
+    std::lock_guard<std::mutex> lck_(_mtx);
+    return (Stats{_queue.size(), _completed.load(),
+                  std::chrono::nanoseconds(_max_delay.load()),
+                  std::chrono::nanoseconds(_total_delay.load())});
+  }
+
+ private:
+  // Callbacks taken by a thread at once
+  static constexpr size_t batch_size = 16;
+  void _serve() {
+    std::vector<RequestPtr> batch_{};
+    std::unique_lock<std::mutex> lck_(_mtx);
+    while (true) {
+      _cv.wait(lck_, [this] { return (_stopping || !_queue.empty()); });
+      if (_queue.empty()) break;
+      _take(batch_, batch_size);
+      lck_.unlock();
+      _call(batch_);
+      lck_.lock();
+    }
+  }
+  // Needs _mtx
+  void _take(std::vector<RequestPtr>& batch, size_t max) {
+    while (!_queue.empty() && batch.size() < max) {
+      batch.push_back(std::move(_queue.front()));
+      _queue.pop_front();
+    }
+    if (_queue.empty() && _fd >= 0) {
+      uint64_t count_ = 0;
+      [[maybe_unused]] auto res_ = read(_fd, &count_, sizeof(count_));
+    }
+  }
+  // Needs _mtx
+  void _signal() noexcept {
+    if (_fd < 0) return;
+    uint64_t one_ = 1;
+    [[maybe_unused]] auto res_ = write(_fd, &one_, sizeof(one_));
+  }
+  void _call(std::vector<RequestPtr>& batch) noexcept {
+    for (auto& r : batch) {
+      auto delay_ = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::steady_clock::now() - r->finished)
+                        .count();
+      _total_delay.fetch_add(delay_, std::memory_order_relaxed);
+      int64_t max_ = _max_delay.load(std::memory_order_relaxed);
+      while (delay_ > max_ && !_max_delay.compare_exchange_weak(max_, delay_))
+        ;
+      try {
+        r->callback();
+      } catch ([[maybe_unused]] const std::exception& e) {
+      }
+      r.reset();
+      _completed.fetch_add(1, std::memory_order_relaxed);
+    }
+    batch.clear();
+  }
+
+  std::mutex _mtx{};
+  std::condition_variable _cv{};
+  std::deque<RequestPtr> _queue{};
+  std::vector<std::thread> _threads{};
+  bool _stopping{false};
+  int _fd{-1};
+  completion _mode{completion::worker};
+  std::atomic<completion> _active{completion::worker};
+  size_t _nthreads{1};
+  std::atomic<size_t> _completed{0};
+  std::atomic<int64_t> _max_delay{0};
+  std::atomic<int64_t> _total_delay{0};
+};
+inline CompletionQueue& completion_queue() {
+  request_pool();  // Outlives the queue, which holds requests
+  static CompletionQueue queue_{};
+  return (queue_);
+}
+
+// One email, built on any thread and sent with others in a batch, see
+// LibCurlWrapperEmail::submit(). It is a move-only value, which starts
+// again as a new message after it was submitted or moved. The stream API
+// of LibCurlWrapperEmail builds the same messages.
+class Message {
+ public:
+  Message() { _request(); }
+  Message(Message&&) noexcept = default;
+  Message& operator=(Message&&) noexcept = default;
+  Message& operator<<(const server& s) {
+    _request().smtp_server.assign(s.name);
     return (*this);
   }
-  // New address
-  LibCurlWrapperEmail& operator<<(const server&& s) {
-    localRequests.emplace_back(new Request);
-    localRequests.back()->smtp_server.assign(s.name);
-    localRequests.back()->email_subject.assign("No subject.");
+  Message& operator<<(const user& u) {
+    Request& req_ = _request();
+    req_.username.assign(u.name);
+    req_.password.assign(u.pass);
     return (*this);
   }
-  LibCurlWrapperEmail& operator<<(const from&& f) {
-    if (localRequests.empty()) return (*this);
-    localRequests.back()->from_address.first.assign(f.name);
-    localRequests.back()->from_address.second.assign(f.email);
+  Message& operator<<(const from& f) {
+    Request& req_ = _request();
+    req_.from_address.first.assign(f.name);
+    req_.from_address.second.assign(f.email);
     return (*this);
   }
-  LibCurlWrapperEmail& operator<<(const to&& t) {
-    if (localRequests.empty()) return (*this);
-    localRequests.back()->to_addresses.emplace_back(t.name, t.email);
+  Message& operator<<(const to& t) {
+    _request().to_addresses.emplace_back(t.name, t.email);
     return (*this);
   }
-  LibCurlWrapperEmail& operator<<(const subject&& s) {
-    if (localRequests.empty()) return (*this);
-    localRequests.back()->email_subject.assign(s.subj);
+  Message& operator<<(const subject& s) {
+    _request().email_subject.assign(s.subj);
     return (*this);
   }
-  LibCurlWrapperEmail& operator<<(const user&& u) {
-    if (localRequests.empty()) return (*this);
-    localRequests.back()->username.assign(u.name);
-    localRequests.back()->password.assign(u.pass);
+  Message& operator<<(const mimetext& data) {
+    _request().sendtext = data.body;
     return (*this);
   }
-  LibCurlWrapperEmail& operator<<(std::packaged_task<void(Request&)>&& cb) {
-    if (localRequests.empty()) return (*this);
-    localRequests.back()->cb =
-        std::forward<std::packaged_task<void(Request&)>>(cb);
+  Message& operator<<(const mimehtml& data) {
+    _request().sendhtml = data.body;
     return (*this);
   }
-  LibCurlWrapperEmail& operator<<(void (*cb)(Request&)) {
-    if (localRequests.empty()) return (*this);
-    localRequests.back()->cb = std::packaged_task<void(Request&)>(cb);
+  Message& operator<<(const mimefile& data) {
+    _request().filenames.emplace_back(data.filename);
     return (*this);
   }
-  LibCurlWrapperEmail& operator<<(const mimetext& data) {
-    if (localRequests.empty()) return (*this);
-    localRequests.back()->sendtext = data.data;
+  Message& operator<<(const prepared& p) {
+    if (!p.msg) return (*this);
+    Request& req_ = _request();
+    req_.prepared_message = p.msg;
+    req_.from_address = p.msg->from_address();
+    req_.email_subject = p.msg->subject();
     return (*this);
   }
-  LibCurlWrapperEmail& operator<<(const mimehtml& data) {
-    if (localRequests.empty()) return (*this);
-    localRequests.back()->sendhtml = data.data;
+  Message& operator<<(const dkim& d) {
+    _request().signer = d.signer;
     return (*this);
   }
-  LibCurlWrapperEmail& operator<<(const mimefile& data) {
-    if (localRequests.empty()) return (*this);
-    localRequests.back()->filenames.emplace_back(data.filename);
+  Message& operator<<(const userdata& uid) {
+    _request().user_data = uid.ptr;
+    return (*this);
+  }
+  Message& operator<<(std::packaged_task<void(Request&)>&& cb) {
+    Request& req_ = _request();
+    req_.cb = std::move(cb);
+    req_.cb_ptr = nullptr;
     return (*this);
   }
-  LibCurlWrapperEmail& operator<<(const userdata& uid) {
+  Message& operator<<(void (*cb)(Request&)) {
+    Request& req_ = _request();
+    req_.cb = std::packaged_task<void(Request&)>();
+    req_.cb_ptr = cb;
+    return (*this);
+  }
+  Message& operator<<(priority p) {
+    _request().lane = p;
+    return (*this);
+  }
+  // Only directive::verbose applies to a message
+  Message& operator<<(directive d) {
+    if (d == directive::verbose) _request().verbose = 1;
+    return (*this);
+  }
+
+ private:
+  friend LibCurlWrapperEmail;
+  explicit Message(RequestPtr req) noexcept : _req(std::move(req)) {}
+  // Null after the message was submitted or moved from
+  RequestPtr _req;
+
+  // A submitted or moved from message starts again as a new one
+  Request& _request() {
+    if (!_req) {
+      _req = request_pool().acquire();
+      _req->email_subject.assign("No subject.");
+    }
+    return (*_req);
+  }
+};
+#if LIBCURLWRAPPERSMTP_COROUTINES
+// Result of co_await LibCurlWrapperEmail::send()
+struct SendResult {
+  CURLcode code{CURLE_OK};
+  long response_code{0};  // Last SMTP reply code
+  std::string error{};
+  // From submit to the start of the transfer, and the transfer itself
+  std::chrono::nanoseconds queued{0};
+  std::chrono::nanoseconds transfer{0};
+};
+// Resumes the coroutine on the thread which finished the send
+struct inline_executor {
+  void operator()(std::coroutine_handle<> h) const { h.resume(); }
+};
+#endif
+// Token bucket of a rate limited user of a server: emails per second, 0
+// is unlimited. It outlives the connection pools of the user, so a rate
+// slower than the expiry of an idle pool still holds.
+struct RateBucket {
+  double rate{0};
+  double burst{1};
+  double tokens{0};
+  std::chrono::steady_clock::time_point refilled{};
+  std::mutex mtx{};
+
+  // Take a token. Returns false and the time of the next token if the
+  // rate limit is reached.
+  bool take(std::chrono::steady_clock::time_point& next) {
+    std::lock_guard<std::mutex> lck_(mtx);
+    if (rate <= 0) return (true);
+    auto now_ = std::chrono::steady_clock::now();
+    _refill(now_);
+    if (tokens >= 1) {
+      tokens -= 1;
+      return (true);
+    }
+    next = now_ + std::chrono::duration_cast<std::chrono::nanoseconds>(
+                      std::chrono::duration<double>((1 - tokens) / rate));
+    return (false);
+  }
+  // Whether taken tokens aren't refilled yet
+  bool used() {
+    std::lock_guard<std::mutex> lck_(mtx);
+    if (rate <= 0) return (false);
+    _refill(std::chrono::steady_clock::now());
+    return (tokens < burst);
+  }
+
+ private:
+  void _refill(std::chrono::steady_clock::time_point now) noexcept {
+    std::chrono::duration<double> elapsed_ = now - refilled;
+    tokens = std::min(burst, tokens + elapsed_.count() * rate);
+    refilled = now;
+  }
+};
+// Pool of keep-alive connections for one user of a server
+struct ServerData {
+  std::string server{};
+  std::string user{};
+  time_t last_connection{time(nullptr)};
+  // Max handles
+  size_t limit;
+  // Created handles
+  size_t total{0};
+  // Free handles. The last one is the most recently used.
+  std::vector<CURL*> idle{};
+  // Rate limit of the user, if it has one
+  std::shared_ptr<RateBucket> bucket{};
+  // Sync senders which wait for a handle or a token
+  size_t waiters{0};
+  // Workers with queued requests which wait for a handle, bit id % 64
+  uint64_t parked{0};
+  std::mutex mtx{};
+  std::condition_variable cv{};
+
+  ServerData() = delete;
+  ServerData(const std::string& s, const std::string& u, size_t l)
+      : server(s), user(u), limit(l) {}
+  // Take a token, see RateBucket::take()
+  bool take_token(std::chrono::steady_clock::time_point& next) {
+    return (!bucket || bucket->take(next));
+  }
+};
+// DNS and TLS session caches shared by all handles. A new connection can
+// skip the name lookup and resume a previous TLS session.
+class SharedCache {
+ public:
+  void init() {
+    if (_share != nullptr) return;
+    _share = curl_share_init();
+    curl_share_setopt(_share, CURLSHOPT_LOCKFUNC, SharedCache::_lock);
+    curl_share_setopt(_share, CURLSHOPT_UNLOCKFUNC, SharedCache::_unlock);
+    curl_share_setopt(_share, CURLSHOPT_USERDATA, this);
+    curl_share_setopt(_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+  }
+  // All attached handles must be cleaned up before
+  void cleanup() {
+    if (_share == nullptr) return;
+    curl_share_cleanup(_share);
+    _share = nullptr;
+  }
+  void attach(CURL* curl) const {
+    if (_share != nullptr) curl_easy_setopt(curl, CURLOPT_SHARE, _share);
+  }
+  ~SharedCache() { cleanup(); }
+
+ private:
+  CURLSH* _share{nullptr};
+  std::array<std::mutex, CURL_LOCK_DATA_LAST> _mtx{};
+
+  static void _lock(CURL*, curl_lock_data data, curl_lock_access,
+                    void* userptr) {
+    static_cast<SharedCache*>(userptr)->_mtx[data].lock();
+  }
+  static void _unlock(CURL*, curl_lock_data data, void* userptr) {
+    static_cast<SharedCache*>(userptr)->_mtx[data].unlock();
+  }
+};
+// For keep-alive connections
+class KeepAliveServers {
+ public:
+  // Check out a connection of the server and user of req and keep its pool
+  // in req.server_data.
+  // Waits for a free connection and for the rate limit.
+  void init_and_lock(Request& req) {
+    _init_and_lock(req, false, nullptr, SIZE_MAX);
+  }
+  // Same as init_and_lock, but returns false if all connections are busy
+  // or the rate limit is reached. Then next is the time of the next token,
+  // if a connection is free. If all are busy, worker is woken when one is
+  // returned, see set_waker().
+  bool try_init_and_lock(Request& req,
+                         std::chrono::steady_clock::time_point* next = nullptr,
+                         size_t worker = SIZE_MAX) {
+    return (_init_and_lock(req, true, next, worker));
+  }
+  // Called with the bits of the workers to wake, see ServerData::parked
+  void set_waker(void (*waker)(uint64_t)) { _waker = waker; }
+  void unlock(Request& req) {
+    ServerData* data_ = req.server_data;
+    if (data_ == nullptr) return;
+    req.server_data = nullptr;
+    uint64_t parked_ = 0;
+    {
+      std::lock_guard<std::mutex> data_lck_(data_->mtx);
+      data_->last_connection = time(nullptr);
+      data_->idle.push_back(req.curl);
+      data_->cv.notify_one();
+      std::swap(parked_, data_->parked);
+    }
+    req.curl = nullptr;
+    _wake(parked_);
+  }
+  // Close the connection of req instead of returning it to the pool
+  void discard(Request& req) {
+    ServerData* data_ = req.server_data;
+    if (data_ == nullptr) return;
+    req.server_data = nullptr;
+    curl_easy_cleanup(req.curl);
+    req.curl = nullptr;
+    uint64_t parked_ = 0;
+    {
+      std::lock_guard<std::mutex> data_lck_(data_->mtx);
+      data_->total--;
+      data_->cv.notify_one();
+      std::swap(parked_, data_->parked);
+    }
+    _wake(parked_);
+  }
+  void clear_old() {
+    // Expiries keys will be erased
+    time_t expiries_ = time(nullptr) - 15;
+    for (auto& shard : _shards) {
+      std::unique_lock<std::shared_mutex> lck_(shard.mtx);
+      for (auto it_ = shard.servers.begin(); it_ != shard.servers.end();) {
+        ServerData& data_ = *it_->second;
+        if (data_.mtx.try_lock()) {
+          // A sync sender may wait for a token longer than the expiry
+          bool unused_ = data_.last_connection < expiries_ &&
+                         data_.idle.size() == data_.total &&
+                         data_.waiters == 0 &&
+                         !(data_.bucket && data_.bucket->used());
+          if (unused_)
+            for (CURL* curl : data_.idle) curl_easy_cleanup(curl);
+          data_.mtx.unlock();
+          if (unused_) {
+            it_ = shard.servers.erase(it_);
+            continue;
+          }
+        }
+        it_++;
+      }
+    }
+  }
+  // Max connections for each user of a server. Default is 1.
+  void set_pool_size(size_t n) {
+    std::lock_guard<std::mutex> lck_(_limits_mtx);
+    _default_limit = n == 0 ? 1 : n;
+  }
+  void set_pool_size(const std::string& server, size_t n) {
+    n = n == 0 ? 1 : n;
+    {
+      std::lock_guard<std::mutex> lck_(_limits_mtx);
+      _limits[server] = n;
+    }
+    for (auto& shard : _shards) {
+      std::shared_lock<std::shared_mutex> lck_(shard.mtx);
+      for (auto& serv : shard.servers) {
+        if (serv.second->server != server) continue;
+        std::lock_guard<std::mutex> data_lck_(serv.second->mtx);
+        serv.second->limit = n;
+        serv.second->cv.notify_all();
+      }
+    }
+  }
+  // Emails per second with bursts of up to burst emails, for each user of
+  // a server or for one user if user isn't empty. 0 is unlimited.
+  void set_rate_limit(const std::string& server, const std::string& user,
+                      double rate, double burst) {
+    _set_policy(server, user, [rate, burst](Policy& p) {
+      p.rate = rate;
+      p.burst = burst < 1 ? 1 : burst;
+    });
+  }
+  // Share of transfers for each user of a server, or for one user
+  void set_weight(const std::string& server, const std::string& user,
+                  unsigned weight) {
+    weight = weight == 0 ? 1 : weight;
+    _set_policy(server, user, [weight](Policy& p) { p.weight = weight; });
+  }
+  unsigned weight(const Request& req) {
+    std::lock_guard<std::mutex> lck_(_limits_mtx);
+    return (_policy(req.smtp_server, req.username).weight);
+  }
+  // CA bundle to verify servers, for connections created from now on
+  void set_ca_file(const std::string& path) {
+    std::lock_guard<std::mutex> lck_(_limits_mtx);
+    _ca_file = path;
+  }
+  // Shared caches for handles created from now on
+  void init_share() { _share.init(); }
+  // Cleanup all connections and shared caches
+  void clear() {
+    for (auto& shard : _shards) {
+      std::unique_lock<std::shared_mutex> lck_(shard.mtx);
+      for (const auto& serv : shard.servers)
+        for (CURL* curl : serv.second->idle) curl_easy_cleanup(curl);
+      shard.servers.clear();
+    }
+    _share.cleanup();
+  }
+  ~KeepAliveServers() { clear(); }
+
+ private:
+  // Pools are spread over shards by key, so senders to different servers
+  // don't contend for a single registry lock.
+  struct Shard {
+    std::shared_mutex mtx{};
+    std::unordered_multimap<uint64_t, std::unique_ptr<ServerData>> servers{};
+  };
+  static constexpr size_t nShards = 64;
+  std::array<Shard, nShards> _shards{};
+  SharedCache _share{};
+  std::mutex _limits_mtx{};
+  std::map<std::string, size_t> _limits{};
+  size_t _default_limit{1};
+  // CA bundle for new connections, the system's one if empty
+  std::string _ca_file{};
+  // Rate limits and weights by server and user. An empty user is any user.
+  struct Policy {
+    double rate{0};
+    double burst{1};
+    unsigned weight{1};
+  };
+  std::map<std::pair<std::string, std::string>, Policy> _policies{};
+  // Token buckets by server and user, created with their first rate limit
+  std::map<std::pair<std::string, std::string>, std::shared_ptr<RateBucket>>
+      _buckets{};
+  std::atomic<void (*)(uint64_t)> _waker{nullptr};
+
+  void _wake(uint64_t parked) const {
+    auto waker_ = _waker.load();
+    if (parked != 0 && waker_ != nullptr) waker_(parked);
+  }
+
+  // Needs _limits_mtx
+  Policy _policy(const std::string& server, const std::string& user) const {
+    auto it_ = _policies.find({server, user});
+    if (it_ == _policies.end()) it_ = _policies.find({server, std::string()});
+    return (it_ != _policies.end() ? it_->second : Policy());
+  }
+  template <class Update>
+  void _set_policy(const std::string& server, const std::string& user,
+                   Update update) {
+    {
+      std::lock_guard<std::mutex> lck_(_limits_mtx);
+      auto it_ = _policies.find({server, user});
+      if (it_ == _policies.end())
+        it_ = _policies.emplace(std::make_pair(server, user),
+                                _policy(server, user)).first;
+      update(it_->second);
+      // Users without their own policy follow the server
+      if (user.empty())
+        for (auto& p : _policies)
+          if (p.first.first == server && !p.first.second.empty())
+            update(p.second);
+    }
+    for (auto& shard : _shards) {
+      std::shared_lock<std::shared_mutex> lck_(shard.mtx);
+      for (auto& serv : shard.servers) {
+        ServerData& data_ = *serv.second;
+        if (data_.server != server || (!user.empty() && data_.user != user))
+          continue;
+        std::lock_guard<std::mutex> data_lck_(data_.mtx);
+        _apply(data_);
+        data_.cv.notify_all();
+      }
+    }
+  }
+  // Rate limit of a pool. Needs data.mtx.
+  void _apply(ServerData& data) {
+    std::lock_guard<std::mutex> lck_(_limits_mtx);
+    Policy p_ = _policy(data.server, data.user);
+    auto it_ = _buckets.find({data.server, data.user});
+    if (it_ == _buckets.end()) {
+      if (p_.rate <= 0) return;
+      it_ = _buckets.emplace(std::make_pair(data.server, data.user),
+                             std::make_shared<RateBucket>()).first;
+      it_->second->tokens = p_.burst;
+      it_->second->refilled = std::chrono::steady_clock::now();
+    }
+    data.bucket = it_->second;
+    std::lock_guard<std::mutex> bucket_lck_(data.bucket->mtx);
+    data.bucket->rate = p_.rate;
+    data.bucket->burst = p_.burst;
+    data.bucket->tokens = std::min(data.bucket->tokens, p_.burst);
+  }
+
+  size_t _limit(const std::string& server) {
+    std::lock_guard<std::mutex> lck_(_limits_mtx);
+    auto it_ = _limits.find(server);
+    return (it_ != _limits.end() ? it_->second : _default_limit);
+  }
+  // Pool of the server and user of req. Keys of different users may
+  // collide, so a pool is only shared by its own user. Needs shard.mtx.
+  static ServerData* _find(Shard& shard, const Request& req) {
+    auto range_ = shard.servers.equal_range(req.key);
+    for (auto it_ = range_.first; it_ != range_.second; ++it_)
+      if (it_->second->server == req.smtp_server &&
+          it_->second->user == req.username)
+        return (it_->second.get());
+    return (nullptr);
+  }
+  // Find the pool of req and lock it. Creates a new pool if needed.
+  std::unique_lock<std::mutex> _lock_pool(Request& req) {
+    Shard& shard_ = _shards[(req.key ^ (req.key >> 32)) % nShards];
+    {
+      std::shared_lock<std::shared_mutex> lck_(shard_.mtx);
+      if (ServerData* data_ = _find(shard_, req)) {
+        req.server_data = data_;
+        return (std::unique_lock<std::mutex>(data_->mtx));
+      }
+    }
+    size_t limit_ = _limit(req.smtp_server);
+    std::unique_lock<std::shared_mutex> lck_(shard_.mtx);
+    ServerData* data_ = _find(shard_, req);
+    if (data_ == nullptr) {
+      data_ = shard_.servers
+                  .emplace(req.key, std::make_unique<ServerData>(
+                                        req.smtp_server, req.username, limit_))
+                  ->second.get();
+      _apply(*data_);
+    }
+    req.server_data = data_;
+    return (std::unique_lock<std::mutex>(data_->mtx));
+  }
+  // Check out a free handle, or create a new one while under the limit
+  bool _init_and_lock(Request& req, bool try_only,
+                      std::chrono::steady_clock::time_point* next,
+                      size_t worker) {
+    std::unique_lock<std::mutex> data_lck_ = _lock_pool(req);
+    ServerData* data_ = req.server_data;
+    data_->last_connection = time(nullptr);
+    while (true) {
+      bool free_ = !data_->idle.empty() || data_->total < data_->limit;
+      std::chrono::steady_clock::time_point next_{};
+      if (free_ && data_->take_token(next_)) break;
+      if (try_only) {
+        if (free_ && next != nullptr) *next = next_;
+        if (!free_ && worker != SIZE_MAX)
+          data_->parked |= uint64_t{1} << (worker % 64);
+        req.server_data = nullptr;
+        return (false);
+      }
+      data_->waiters++;
+      if (free_)
+        data_->cv.wait_until(data_lck_, next_);
+      else
+        data_->cv.wait(data_lck_);
+      data_->waiters--;
+    }
+    if (!data_->idle.empty()) {  // Get existing
+      req.curl = data_->idle.back();
+      data_->idle.pop_back();
+    } else {
+      req.init();
+      _share.attach(req.curl);
+      {
+        std::lock_guard<std::mutex> lck_(_limits_mtx);
+        if (!_ca_file.empty())
+          curl_easy_setopt(req.curl, CURLOPT_CAINFO, _ca_file.c_str());
+      }
+      data_->total++;
+    }
+    return (true);
+  }
+};
+
+// Requests waiting for a retry, in a hashed wheel of tick wide slots.
+// Adding and expiring are O(1); a request due after a full turn stays in
+// its slot for more turns. Owned by one thread.
+class TimerWheel {
+ public:
+  using clock = std::chrono::steady_clock;
+  static constexpr size_t nSlots = 512;
+  static constexpr std::chrono::milliseconds tick{10};
+
+  bool empty() const noexcept { return (_size == 0); }
+  size_t size() const noexcept { return (_size); }
+  void add(RequestPtr&& req, clock::time_point due) {
+    uint64_t tick_ = std::max(_tick(due, true), _current + 1);
+    _slots[tick_ % nSlots].emplace_back(due, std::move(req));
+    _size++;
+  }
+  // Move requests which are due by now into out
+  void advance(clock::time_point now, std::vector<RequestPtr>& out) {
+    uint64_t target_ = _tick(now, false);
+    if (target_ <= _current) return;
+    if (_size != 0) {
+      // Each slot is visited once, even after a long sleep
+      uint64_t first_ = _current + 1;
+      if (target_ - _current > nSlots) first_ = target_ - (nSlots - 1);
+      for (uint64_t t = first_; t <= target_; ++t) {
+        auto& slot_ = _slots[t % nSlots];
+        for (size_t i = 0; i < slot_.size();) {
+          if (slot_[i].first > now) {
+            ++i;
+            continue;
+          }
+          out.push_back(std::move(slot_[i].second));
+          slot_[i] = std::move(slot_.back());
+          slot_.pop_back();
+          _size--;
+        }
+      }
+    }
+    _current = target_;
+  }
+  // When the next slot with requests expires, or max() if there is none
+  clock::time_point next() const noexcept {
+    if (_size == 0) return (clock::time_point::max());
+    for (uint64_t t = _current + 1; t <= _current + nSlots; ++t)
+      if (!_slots[t % nSlots].empty()) return (_origin + tick * t);
+    return (clock::time_point::max());
+  }
+  // Move all requests into out
+  void clear(std::vector<RequestPtr>& out) {
+    for (auto& slot : _slots) {
+      for (auto& entry : slot) out.push_back(std::move(entry.second));
+      slot.clear();
+    }
+    _size = 0;
+  }
+
+ private:
+  // Due times are rounded up and now is rounded down, so a slot expires
+  // after all of its requests
+  uint64_t _tick(clock::time_point t, bool up) const noexcept {
+    if (t <= _origin) return (0);
+    auto d_ = t - _origin;
+    if (up) d_ += tick - clock::duration(1);
+    return (static_cast<uint64_t>(d_ / tick));
+  }
+  clock::time_point _origin{clock::now()};
+  uint64_t _current{0};
+  size_t _size{0};
+  std::array<std::vector<std::pair<clock::time_point, RequestPtr>>, nSlots>
+      _slots{};
+};
+
+// CRC-32C (Castagnoli) of spool records
+inline uint32_t _crc32c_scalar(const unsigned char* in, size_t size,
+                               uint32_t crc) noexcept {
+  static const auto table_ = []() {
+    std::array<uint32_t, 256> table{};
+    for (uint32_t i = 0; i < 256; ++i) {
+      uint32_t c_ = i;
+      for (int k = 0; k < 8; ++k)
+        c_ = (c_ >> 1) ^ (0x82f63b78U & (0U - (c_ & 1)));
+      table[i] = c_;
+    }
+    return (table);
+  }();
+  for (size_t i = 0; i < size; ++i)
+    crc = table_[(crc ^ in[i]) & 0xff] ^ (crc >> 8);
+  return (crc);
+}
+#if LIBCURLWRAPPERSMTP_X86
+__attribute__((target("sse4.2"))) inline uint32_t _crc32c_sse42(
+    const unsigned char* in, size_t size, uint32_t crc) noexcept {
+#if defined(__x86_64__)
+  uint64_t crc64_ = crc;
+  for (; size >= 8; in += 8, size -= 8) {
+    uint64_t v_;
+    memcpy(&v_, in, 8);
+    crc64_ = _mm_crc32_u64(crc64_, v_);
+  }
+  auto crc_ = static_cast<uint32_t>(crc64_);
+#else  // 32-bit x86 has no 64-bit CRC32 instruction
+  uint32_t crc_ = crc;
+  for (; size >= 4; in += 4, size -= 4) {
+    uint32_t v_;
+    memcpy(&v_, in, 4);
+    crc_ = _mm_crc32_u32(crc_, v_);
+  }
+#endif
+  for (; size > 0; ++in, --size) crc_ = _mm_crc32_u8(crc_, *in);
+  return (crc_);
+}
+#endif
+inline uint32_t crc32c(const void* data, size_t size,
+                       uint32_t crc = 0) noexcept {
+  const auto* in_ = static_cast<const unsigned char*>(data);
+#if LIBCURLWRAPPERSMTP_X86
+  static const bool sse42_ = []() {
+    __builtin_cpu_init();
+    return (__builtin_cpu_supports("sse4.2") != 0);
+  }();
+  if (sse42_) return (~_crc32c_sse42(in_, size, ~crc));
+#endif
+  return (~_crc32c_scalar(in_, size, ~crc));
+}
+
+// Append-only journal of async requests, in segment files of a directory.
+// A request is journaled with its envelope and serialized message, and a
+// tombstone marks it done. One thread writes the records and flushes all
+// records appended meanwhile with one fdatasync. Sealed segments are
+// deleted oldest first, once their requests are done: tombstones may be for
+// requests in older segments. The oldest is compacted when few are left.
+// Record: length and CRC-32C of the body, then type, id and payload.
+class Spool {
+ public:
+  struct Stats {
+    size_t live{0};  // Journaled requests which aren't done
+    size_t segments{0};
+    size_t commits{0};  // Flushes, each for a group of appends
+    size_t records{0};
+    size_t compacted{0};  // Segments rewritten by compaction
+  };
+  // Open or create the journal in dir and read the requests which weren't
+  // done. Throws std::runtime_error.
+  Spool(const std::string& dir, size_t segment_size)
+      : _dir(dir), _segment_size(std::max<size_t>(segment_size, 4096)) {
+    if (mkdir(dir.c_str(), 0700) != 0 && errno != EEXIST)
+      throw std::runtime_error("Can't create spool " + dir);
+    _dir_fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (_dir_fd < 0) throw std::runtime_error("Can't open spool " + dir);
+    try {
+      _scan();
+    } catch (...) {
+      close(_dir_fd);
+      throw;
+    }
+    _thread = std::thread(&Spool::_run, this);
+  }
+  Spool(const Spool&) = delete;
+  Spool& operator=(const Spool&) = delete;
+  // Flush tombstones and stop the writer
+  ~Spool() {
+    {
+      std::lock_guard<std::mutex> lck_(_mtx);
+      _stopping = true;
+    }
+    _cv.notify_one();
+    _thread.join();
+    if (_fd >= 0) close(_fd);
+    close(_dir_fd);
+  }
+  // Journal requests with a serialized message and wait until they are on
+  // disk. Their spool ids are set. Returns false on a write error.
+  bool append(Request* const* reqs, size_t count) {
+    if (count == 0) return (true);
+    std::string batch_{};
+    std::vector<std::pair<uint64_t, uint32_t>> records_{};  // Id and size
+    records_.reserve(count);
+    uint64_t id_ = _next_id.fetch_add(count);
+    for (size_t i = 0; i < count; ++i, ++id_) {
+      size_t start_ = batch_.size();
+      _encode(*reqs[i], id_, batch_);
+      records_.emplace_back(id_, static_cast<uint32_t>(batch_.size() - start_));
+    }
+    std::unique_lock<std::mutex> lck_(_mtx);
+    if (_failed) return (false);
+    uint64_t offset_ = _push(batch_);
+    Segment& seg_ = _segments[_write_seg];
+    for (const auto& rec : records_) {
+      _live[rec.first] = Location{_write_seg, offset_, rec.second};
+      seg_.live++;
+      seg_.live_bytes += rec.second;
+      offset_ += rec.second;
+    }
+    _records += count;
+    uint64_t lsn_ = ++_lsn;
+    _cv.notify_one();
+    _cv_flushed.wait(lck_,
+                     [this, lsn_] { return (_flushed >= lsn_ || _failed); });
+    if (_flushed < lsn_) return (false);
+    for (size_t i = 0; i < count; ++i) reqs[i]->spool_id = records_[i].first;
+    return (true);
+  }
+  // Mark a request done. The tombstone is flushed with the next group, so
+  // a crash may send the request again.
+  void complete(uint64_t id) {
+    std::string record_{};
+    _begin(record_, record::tombstone, id);
+    _seal(record_, 0);
+    std::lock_guard<std::mutex> lck_(_mtx);
+    auto it_ = _live.find(id);
+    if (it_ == _live.end()) return;
+    _forget(it_->second);
+    _live.erase(it_);
+    _push(record_);
+    _records++;
+    if (_pending_bytes >= nFlushBytes) _cv.notify_one();
+  }
+  // Requests which weren't done when the journal was opened, in the order
+  // of their ids. Their spool ids are set. Only the first call returns them.
+  std::vector<RequestPtr> replay() { return (std::move(_replayed)); }
+  Stats stats() const {
+    std::lock_guard<std::mutex> lck_(_mtx);
+    Stats stats_{_live.size(), 0, _commits, _records, _compacted};
+    for (const auto& seg : _segments)
+      if (seg.second.size != 0) stats_.segments++;
+    return (stats_);
+  }
+
+ private:
+  enum class record : unsigned char { enqueue = 1, tombstone = 2 };
+  static constexpr size_t nHeader = 8;  // Length and CRC
+  static constexpr size_t nFlushBytes = 1 << 20;
+  struct Location {
+    uint64_t segment{0};
+    uint64_t offset{0};
+    uint32_t size{0};
+  };
+  struct Segment {
+    size_t live{0};
+    uint64_t live_bytes{0};
+    uint64_t size{0};
+  };
+  // Records of one segment which aren't written yet
+  struct Chunk {
+    uint64_t segment{0};
+    std::string data{};
+  };
+
+  std::string _name(uint64_t segment) const {
+    char name_[32];
+    snprintf(name_, sizeof(name_), "spool-%012llu.log",
+             static_cast<unsigned long long>(segment));
+    return (name_);
+  }
+  static void _put(std::string& out, const void* data, size_t size) {
+    out.append(static_cast<const char*>(data), size);
+  }
+  static void _put(std::string& out, std::string_view str) {
+    auto size_ = static_cast<uint32_t>(str.size());
+    _put(out, &size_, sizeof(size_));
+    out.append(str);
+  }
+  static bool _get(std::string_view& in, void* data, size_t size) {
+    if (in.size() < size) return (false);
+    memcpy(data, in.data(), size);
+    in.remove_prefix(size);
+    return (true);
+  }
+  static bool _get(std::string_view& in, std::string& str) {
+    uint32_t size_ = 0;
+    if (!_get(in, &size_, sizeof(size_)) || in.size() < size_) return (false);
+    str.assign(in.data(), size_);
+    in.remove_prefix(size_);
+    return (true);
+  }
+  static void _begin(std::string& out, record type, uint64_t id) {
+    out.append(nHeader, '\0');
+    out.push_back(static_cast<char>(type));
+    _put(out, &id, sizeof(id));
+  }
+  // Write length and CRC of the record which starts at start
+  static void _seal(std::string& out, size_t start) {
+    auto size_ = static_cast<uint32_t>(out.size() - start - nHeader);
+    uint32_t crc_ = crc32c(out.data() + start + nHeader, size_);
+    memcpy(&out[start], &size_, sizeof(size_));
+    memcpy(&out[start + 4], &crc_, sizeof(crc_));
+  }
+  static void _encode(const Request& req, uint64_t id, std::string& out) {
+    size_t start_ = out.size();
+    _begin(out, record::enqueue, id);
+    for (const auto* str :
+         {&req.smtp_server, &req.username, &req.password,
+          &req.from_address.first, &req.from_address.second,
+          &req.email_subject})
+      _put(out, *str);
+    auto n_ = static_cast<uint32_t>(req.to_addresses.size());
+    _put(out, &n_, sizeof(n_));
+    for (const auto& to_address : req.to_addresses) {
+      _put(out, to_address.first);
+      _put(out, to_address.second);
+    }
+    out.push_back(static_cast<char>(req.lane));
+    out.push_back(static_cast<char>(req.verbose != 0));
+    _put(out, req.spooled);
+    _seal(out, start_);
+  }
+  static bool _decode(std::string_view in, Request& req) {
+    for (auto* str : {&req.smtp_server, &req.username, &req.password,
+                      &req.from_address.first, &req.from_address.second,
+                      &req.email_subject})
+      if (!_get(in, *str)) return (false);
+    uint32_t n_ = 0;
+    if (!_get(in, &n_, sizeof(n_))) return (false);
+    for (uint32_t i = 0; i < n_; ++i) {
+      std::pair<std::string, std::string> to_address_{};
+      if (!_get(in, to_address_.first) || !_get(in, to_address_.second))
+        return (false);
+      req.to_addresses.push_back(std::move(to_address_));
+    }
+    unsigned char lane_ = 0;
+    unsigned char verbose_ = 0;
+    if (!_get(in, &lane_, 1) || !_get(in, &verbose_, 1) ||
+        lane_ >= 3 || !_get(in, req.spooled))
+      return (false);
+    req.lane = static_cast<priority>(lane_);
+    req.verbose = verbose_;
+    return (!req.spooled.empty());
+  }
+  // Add records to the write segment. Returns their offset. Needs _mtx.
+  uint64_t _push(std::string_view data) {
+    if (_segments[_write_seg].size >= _segment_size) _segments[++_write_seg];
+    if (_chunks.empty() || _chunks.back().segment != _write_seg)
+      _chunks.push_back(Chunk{_write_seg, std::string()});
+    _chunks.back().data.append(data);
+    Segment& seg_ = _segments[_write_seg];
+    uint64_t offset_ = seg_.size;
+    seg_.size += data.size();
+    _pending_bytes += data.size();
+    return (offset_);
+  }
+  // A record which isn't live anymore. Needs _mtx.
+  void _forget(const Location& loc) {
+    Segment& seg_ = _segments[loc.segment];
+    seg_.live--;
+    seg_.live_bytes -= loc.size;
+  }
+  static bool _read(int fd, uint64_t offset, size_t size, std::string& out) {
+    size_t old_ = out.size();
+    out.resize(old_ + size);
+    size_t done_ = 0;
+    while (done_ < size) {
+      ssize_t n_ = pread(fd, &out[old_ + done_], size - done_,
+                         static_cast<off_t>(offset + done_));
+      if (n_ < 0 && errno == EINTR) continue;
+      if (n_ <= 0) return (false);
+      done_ += static_cast<size_t>(n_);
+    }
+    return (true);
+  }
+  // Read the segments in order. A torn record at the end of the last one
+  // is cut off. Requests which weren't done are decoded for replay().
+  void _scan() {
+    std::vector<uint64_t> segments_{};
+    if (DIR* dir_ = opendir(_dir.c_str())) {
+      while (dirent* ent_ = readdir(dir_)) {
+        if (strncmp(ent_->d_name, "spool-", 6) != 0) continue;
+        uint64_t n_ = strtoull(ent_->d_name + 6, nullptr, 10);
+        if (n_ != 0 && _name(n_) == ent_->d_name) segments_.push_back(n_);
+      }
+      closedir(dir_);
+    }
+    std::sort(segments_.begin(), segments_.end());
+    uint64_t max_id_ = 0;
+    std::string data_{};
+    for (size_t i = 0; i < segments_.size(); ++i) {
+      uint64_t segment_ = segments_[i];
+      int fd_ = openat(_dir_fd, _name(segment_).c_str(), O_RDWR | O_CLOEXEC);
+      struct stat st_ {};
+      data_.clear();
+      if (fd_ < 0 || fstat(fd_, &st_) != 0 ||
+          !_read(fd_, 0, static_cast<size_t>(st_.st_size), data_)) {
+        if (fd_ >= 0) close(fd_);
+        throw std::runtime_error("Can't read spool segment " +
+                                 _name(segment_));
+      }
+      Segment& seg_ = _segments[segment_];
+      size_t offset_ = 0;
+      while (data_.size() - offset_ >= nHeader + 9) {
+        uint32_t size_ = 0;
+        uint32_t crc_ = 0;
+        memcpy(&size_, data_.data() + offset_, 4);
+        memcpy(&crc_, data_.data() + offset_ + 4, 4);
+        const char* body_ = data_.data() + offset_ + nHeader;
+        if (size_ < 9 || size_ > data_.size() - offset_ - nHeader ||
+            crc32c(body_, size_) != crc_)
+          break;
+        auto type_ = static_cast<record>(body_[0]);
+        uint64_t id_ = 0;
+        memcpy(&id_, body_ + 1, sizeof(id_));
+        max_id_ = std::max(max_id_, id_);
+        auto it_ = _live.find(id_);
+        if (it_ != _live.end()) _forget(it_->second);
+        if (type_ == record::enqueue) {
+          // A compacted copy replaces the older record
+          Location loc_{segment_, offset_,
+                        static_cast<uint32_t>(nHeader + size_)};
+          _live[id_] = loc_;
+          seg_.live++;
+          seg_.live_bytes += loc_.size;
+        } else if (it_ != _live.end()) {
+          _live.erase(it_);
+        }
+        offset_ += nHeader + size_;
+      }
+      seg_.size = offset_;
+      if (offset_ != data_.size() && i + 1 == segments_.size() &&
+          ftruncate(fd_, static_cast<off_t>(offset_)) != 0) {
+        close(fd_);
+        throw std::runtime_error("Can't truncate spool segment " +
+                                 _name(segment_));
+      }
+      close(fd_);
+    }
+    _next_id = max_id_ + 1;
+    _write_seg = segments_.empty() ? 1 : segments_.back() + 1;
+    _segments[_write_seg];
+    // Decode in the order of submission
+    std::vector<std::pair<uint64_t, Location>> live_(_live.begin(),
+                                                     _live.end());
+    std::sort(live_.begin(), live_.end(),
+              [](const auto& a, const auto& b) { return (a.first < b.first); });
+    int fd_ = -1;
+    uint64_t fd_segment_ = 0;
+    for (const auto& l : live_) {
+      if (l.second.segment != fd_segment_) {
+        if (fd_ >= 0) close(fd_);
+        fd_ = openat(_dir_fd, _name(l.second.segment).c_str(),
+                     O_RDONLY | O_CLOEXEC);
+        fd_segment_ = l.second.segment;
+      }
+      RequestPtr req_ = request_pool().acquire();
+      data_.clear();
+      if (fd_ >= 0 && _read(fd_, l.second.offset, l.second.size, data_) &&
+          _decode(std::string_view(data_).substr(nHeader + 9), *req_)) {
+        req_->spool_id = l.first;
+        _replayed.push_back(std::move(req_));
+        continue;
+      }
+      // Unreadable, it can't be sent
+      _forget(l.second);
+      _live.erase(l.first);
+    }
+    if (fd_ >= 0) close(fd_);
+  }
+  // Write chunks and flush the last segment. Returns false on error.
+  bool _write(const std::vector<Chunk>& chunks) {
+    for (const auto& chunk : chunks) {
+      if (chunk.segment != _fd_segment || _fd < 0) {
+        if (_fd >= 0) {
+          if (fdatasync(_fd) != 0) return (false);
+          close(_fd);
+        }
+        _fd = openat(_dir_fd, _name(chunk.segment).c_str(),
+                     O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+        _fd_segment = chunk.segment;
+        // The new file must survive a crash too
+        if (_fd < 0 || fsync(_dir_fd) != 0) return (false);
+      }
+      size_t done_ = 0;
+      while (done_ < chunk.data.size()) {
+        ssize_t n_ = write(_fd, chunk.data.data() + done_,
+                           chunk.data.size() - done_);
+        if (n_ < 0 && errno == EINTR) continue;
+        if (n_ <= 0) return (false);
+        done_ += static_cast<size_t>(n_);
+      }
+    }
+    return (chunks.empty() || fdatasync(_fd) == 0);
+  }
+  // Copy the live records of the oldest segment into the write segment,
+  // if few are left, so it doesn't hold up the deletion of the segments
+  // after it. It is deleted after the copies are flushed.
+  void _compact() {
+    uint64_t segment_ = 0;
+    std::vector<std::pair<uint64_t, Location>> items_{};
+    {
+      std::lock_guard<std::mutex> lck_(_mtx);
+      // Done segments before it are being deleted
+      auto it_ = _segments.begin();
+      while (it_->first != _write_seg && it_->second.live == 0) ++it_;
+      if (it_->first == _write_seg ||
+          static_cast<double>(it_->second.live_bytes) >=
+              0.25 * static_cast<double>(it_->second.size))
+        return;
+      segment_ = it_->first;
+      for (const auto& l : _live)
+        if (l.second.segment == segment_) items_.push_back(l);
+    }
+    std::sort(items_.begin(), items_.end(), [](const auto& a, const auto& b) {
+      return (a.second.offset < b.second.offset);
+    });
+    int fd_ = openat(_dir_fd, _name(segment_).c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd_ < 0) return;
+    std::string data_{};
+    bool ok_ = true;
+    for (const auto& item : items_)
+      ok_ = ok_ && _read(fd_, item.second.offset, item.second.size, data_);
+    close(fd_);
+    if (!ok_) return;
+    std::lock_guard<std::mutex> lck_(_mtx);
+    size_t pos_ = 0;
+    bool moved_ = false;
+    for (const auto& item : items_) {
+      std::string_view record_(data_.data() + pos_, item.second.size);
+      pos_ += item.second.size;
+      auto it_ = _live.find(item.first);
+      if (it_ == _live.end() || it_->second.segment != segment_) continue;
+      _forget(it_->second);
+      uint64_t offset_ = _push(record_);
+      it_->second = Location{_write_seg, offset_, item.second.size};
+      Segment& seg_ = _segments[_write_seg];
+      seg_.live++;
+      seg_.live_bytes += item.second.size;
+      moved_ = true;
+    }
+    if (!moved_) return;
+    _compacted++;
+    _lsn++;  // Flush the copies at once
+  }
+  // Group commit: whatever was appended while the last group was written
+  // goes into the next one
+  void _run() {
+    std::unique_lock<std::mutex> lck_(_mtx);
+    while (true) {
+      _cv.wait_for(lck_, std::chrono::seconds(1), [this] {
+        return (_stopping || _flushed != _lsn || _pending_bytes >= nFlushBytes);
+      });
+      std::vector<Chunk> chunks_{};
+      chunks_.swap(_chunks);
+      // Done segments without older ones
+      std::vector<uint64_t> dead_{};
+      for (const auto& seg : _segments) {
+        if (seg.first == _write_seg || seg.second.live != 0) break;
+        dead_.push_back(seg.first);
+      }
+      uint64_t lsn_ = _lsn;
+      bool stopping_ = _stopping;
+      _pending_bytes = 0;
+      lck_.unlock();
+      bool ok_ = _write(chunks_);
+      // Done segments go after their tombstones and compacted copies
+      if (ok_)
+        for (uint64_t segment : dead_)
+          unlinkat(_dir_fd, _name(segment).c_str(), 0);
+      if (ok_ && !stopping_) _compact();
+      lck_.lock();
+      if (!chunks_.empty()) _commits++;
+      if (ok_) {
+        _flushed = std::max(_flushed, lsn_);
+        for (uint64_t segment : dead_) _segments.erase(segment);
+      } else {
+        _failed = true;
+      }
+      _cv_flushed.notify_all();
+      if (stopping_ && (_chunks.empty() || _failed)) break;
+    }
+  }
+
+  std::string _dir;
+  size_t _segment_size;
+  int _dir_fd{-1};
+  // File of the segment which the writer appends to
+  int _fd{-1};
+  uint64_t _fd_segment{0};
+  std::atomic<uint64_t> _next_id{1};
+  std::vector<RequestPtr> _replayed{};
+  mutable std::mutex _mtx{};
+  std::condition_variable _cv{};
+  std::condition_variable _cv_flushed{};
+  std::unordered_map<uint64_t, Location> _live{};
+  std::map<uint64_t, Segment> _segments{};
+  uint64_t _write_seg{1};
+  std::vector<Chunk> _chunks{};
+  size_t _pending_bytes{0};
+  // Groups of appends, and the last one on disk
+  uint64_t _lsn{0};
+  uint64_t _flushed{0};
+  bool _failed{false};
+  bool _stopping{false};
+  size_t _commits{0};
+  size_t _records{0};
+  size_t _compacted{0};
+  std::thread _thread{};
+};
+
+class LibCurlWrapperEmail {
+ public:
+  // Async requests which are queued or running
+  size_t globalSize() const noexcept { return (nQueued); }
+  // Approximate memory held by async requests
+  size_t globalBytes() const noexcept { return (nQueuedBytes); }
+  size_t localSize() const noexcept { return (localRequests.size()); }
+  // class control
+  LibCurlWrapperEmail& operator<<(directive d) {
     if (localRequests.empty()) return (*this);
-    localRequests.back()->user_data = uid.ptr;
+    switch (d) {
+      case directive::syncperform:
+        _perform(localRequests.data(), localRequests.size());
+        localRequests.clear();
+        break;
+      case directive::asyncperform:
+        submit();
+        break;
+      case directive::asyncperform_high:
+        for (auto& m : localRequests) m << priority::high;
+        submit();
+        break;
+      default:
+        localRequests.back() << d;
+        break;
+    }
+    return (*this);
+  }
+  // New address
+  LibCurlWrapperEmail& operator<<(const server&& s) {
+    localRequests.emplace_back();
+    localRequests.back() << s;
     return (*this);
   }
+  // Fields of the last message
+  LibCurlWrapperEmail& operator<<(const from&& f) { return (_set(f)); }
+  LibCurlWrapperEmail& operator<<(const to&& t) { return (_set(t)); }
+  LibCurlWrapperEmail& operator<<(const subject&& s) { return (_set(s)); }
+  LibCurlWrapperEmail& operator<<(const user&& u) { return (_set(u)); }
+  LibCurlWrapperEmail& operator<<(std::packaged_task<void(Request&)>&& cb) {
+    return (_set(std::move(cb)));
+  }
+  LibCurlWrapperEmail& operator<<(void (*cb)(Request&)) { return (_set(cb)); }
+  // Mail-merge: one personalized email for each record. The last local
+  // request is the prototype: its server, user, sender, files and callback
+  // are used for every record. Only a function pointer callback is copied.
+  // Records are moved if the iterators are std::move_iterator.
+  template <class InputIt>
+  LibCurlWrapperEmail& mailmerge(std::shared_ptr<const MergeTemplate> tmpl,
+                                 InputIt first, InputIt last) {
+    if (localRequests.empty() || !tmpl) return (*this);
+    Message proto_ = std::move(localRequests.back());
+    localRequests.pop_back();
+    for (; first != last; ++first) {
+      auto&& record_ = *first;
+      localRequests.emplace_back();
+      Request& req_ = *localRequests.back()._req;
+      req_.copy_envelope(*proto_._req);
+      req_.merge_template = tmpl;
+      req_.to_addresses.emplace_back(
+          std::forward<decltype(record_)>(record_).name,
+          std::forward<decltype(record_)>(record_).email);
+      req_.merge_values = std::forward<decltype(record_)>(record_).values;
+      if (!tmpl->_subject.empty())
+        tmpl->_subject.render(req_.merge_values, req_.email_subject);
+    }
+    return (*this);
+  }
+  LibCurlWrapperEmail& mailmerge(std::shared_ptr<const MergeTemplate> tmpl,
+                                 const std::vector<MergeRecord>& records) {
+    return (mailmerge(std::move(tmpl), records.cbegin(), records.cend()));
+  }
+  LibCurlWrapperEmail& operator<<(const mimetext& data) { return (_set(data)); }
+  LibCurlWrapperEmail& operator<<(const mimehtml& data) { return (_set(data)); }
+  LibCurlWrapperEmail& operator<<(const mimefile& data) { return (_set(data)); }
+  LibCurlWrapperEmail& operator<<(const prepared& p) { return (_set(p)); }
+  LibCurlWrapperEmail& operator<<(const dkim& d) { return (_set(d)); }
+  LibCurlWrapperEmail& operator<<(const userdata& uid) { return (_set(uid)); }
+  LibCurlWrapperEmail& operator<<(priority p) { return (_set(p)); }
   LibCurlWrapperEmail() {
+    // Other threads wait until global init is finished
+    std::lock_guard<std::mutex> lck_(mtxInstances);
     size_t old = nInstances++;
-    if (old == 0) curl_global_init(CURL_GLOBAL_DEFAULT);
-    run();
+    if (old == 0) {
+      curl_global_init(CURL_GLOBAL_DEFAULT);
+      _servers.init_share();
+      _servers.set_waker(&LibCurlWrapperEmail::_wake_parked);
+      run();
+    }
   }
   ~LibCurlWrapperEmail() {
+    std::lock_guard<std::mutex> lck_(mtxInstances);
     auto old = --nInstances;
-    if (old == 0) curl_global_cleanup();
-    stop();
+    if (old == 0) {
+      stop();
+      _servers.clear();
+      curl_global_cleanup();
+    }
+  }
+  // Send local requests asynchronously. Returns false if the async queue
+  // is full and the requests were rejected or dropped.
+  bool submit() { return (submit(std::move(localRequests))); }
+  // Send messages asynchronously, with one reservation in the queue and
+  // one push for each worker. Returns false if the async queue is full:
+  // rejected messages are left in msgs, dropped ones are called back
+  // with an error.
+  bool submit(std::vector<Message>&& msgs) {
+    // The policy may change meanwhile
+    overflow policy_ = overflowPolicy;
+    bool ok_ = _enqueue(msgs.data(), msgs.size(), policy_);
+    if (ok_ || policy_ != overflow::reject) msgs.clear();
+    return (ok_);
+  }
+  bool submit(Message* msgs, size_t count) {
+    return (_enqueue(msgs, count, overflowPolicy));
+  }
+#if LIBCURLWRAPPERSMTP_COROUTINES
+  // Sends msg asynchronously when awaited, see send()
+  template <class Executor>
+  class SendAwaiter {
+   public:
+    SendAwaiter(LibCurlWrapperEmail& emailer, Message&& msg, Executor ex)
+        : _emailer(emailer), _msg(std::move(msg)), _ex(std::move(ex)) {
+      if (_msg._req) return;
+      _result.code = CURLE_BAD_FUNCTION_ARGUMENT;
+      _result.error.assign("Empty message!");
+    }
+    bool await_ready() const noexcept { return (!_msg._req); }
+    bool await_suspend(std::coroutine_handle<> h) {
+      _handle = h;
+      _msg._req->notify = &SendAwaiter::_resume;
+      _msg._req->notify_ctx = this;
+      overflow policy_ = overflowPolicy;
+      if (_emailer._enqueue(&_msg, 1, policy_)) return (true);
+      // A dropped message was called back already
+      if (policy_ == overflow::drop) return (true);
+      _result.code = CURLE_SEND_ERROR;
+      _result.error.assign("Queue is full!");
+      return (false);
+    }
+    SendResult await_resume() { return (std::move(_result)); }
+
+   private:
+    static void _resume(Request& req, void* ctx) {
+      auto* this_ = static_cast<SendAwaiter*>(ctx);
+      SendResult& res_ = this_->_result;
+      res_.code = req.result;
+      res_.response_code = req.response_code;
+      res_.error = std::move(req.error);
+      auto started_ = req.started == std::chrono::steady_clock::time_point{}
+                          ? req.finished
+                          : req.started;
+      res_.queued = started_ - req.submitted;
+      res_.transfer = req.finished - started_;
+      this_->_ex(this_->_handle);
+    }
+    LibCurlWrapperEmail& _emailer;
+    Message _msg;
+    Executor _ex;
+    std::coroutine_handle<> _handle{};
+    SendResult _result{};
+  };
+  // co_await send(msg) sends msg asynchronously and returns its result.
+  // The coroutine is resumed by ex(handle) on the worker or callback
+  // thread; no thread waits for the send. The overflow policy applies.
+  template <class Executor = inline_executor>
+  SendAwaiter<Executor> send(Message&& msg, Executor ex = Executor()) {
+    return (SendAwaiter<Executor>(*this, std::move(msg), std::move(ex)));
+  }
+#endif
+  // Limits for async requests which are queued or running. 0 is unlimited.
+  static void set_queue_limits(size_t max_messages, size_t max_bytes,
+                               overflow policy = overflow::block) noexcept {
+    maxQueued = max_messages;
+    maxQueuedBytes = max_bytes;
+    overflowPolicy = policy;
+  }
+  // Memory for base64 encoded attachments, 64 MiB by default
+  static void set_attachment_cache(size_t bytes) {
+    attachment_cache().set_budget(bytes);
+  }
+  static AttachmentCache::Stats attachment_stats() {
+    return (attachment_cache().stats());
+  }
+  // Max recycled requests kept for reuse, 4096 by default
+  static void set_request_pool(size_t n) { request_pool().set_limit(n); }
+  static RequestPool::Stats request_pool_stats() {
+    return (request_pool().stats());
+  }
+  // Number of sender threads for async performs.
+  // Takes effect when the first instance is created.
+  static void set_workers(size_t n) noexcept { nWorkers = n == 0 ? 1 : n; }
+  // Max async transfers running at once, over all servers. Servers and
+  // users share it by their weights. 0 is unlimited, the default.
+  static void set_max_in_flight(size_t n) noexcept { maxInFlight = n; }
+  // Retry async sends which failed with a 4xx reply or a network error,
+  // up to max_retries times. The delay doubles from base up to cap, with
+  // random jitter of up to half of it. Default is no retries.
+  static void set_retry(unsigned max_retries,
+                        std::chrono::milliseconds base = std::chrono::seconds(1),
+                        std::chrono::milliseconds cap = std::chrono::minutes(5)) {
+    retryMax = max_retries;
+    retryBase = std::max<int64_t>(1, base.count());
+    retryCap = std::max<int64_t>(retryBase, cap.count());
+  }
+  // While higher lanes have work, a lower lane is served once after n
+  // starts of higher lanes. Default is 16.
+  static void set_starvation_limit(size_t n) noexcept {
+    starvationLimit = n == 0 ? 1 : n;
+  }
+  struct LaneStats {
+    size_t waiting{0};  // Submitted, not started
+    size_t started{0};
+    // Wait from submit to the start of the transfer
+    std::chrono::nanoseconds p50{0};
+    std::chrono::nanoseconds p90{0};
+    std::chrono::nanoseconds p99{0};
+  };
+  static LaneStats lane_stats(priority p) {
+    const LatencyHistogram& wait_ = laneWait[static_cast<size_t>(p)];
+    return (LaneStats{laneWaiting[static_cast<size_t>(p)].load(),
+                      wait_.count(), wait_.percentile(50),
+                      wait_.percentile(90), wait_.percentile(99)});
+  }
+  // Emails per second with bursts of up to burst emails, for each user of
+  // a server or for one user. 0 is unlimited, the default.
+  static void set_rate_limit(const char* srv, double rate, double burst = 1) {
+    _servers.set_rate_limit(srv, std::string(), rate, burst);
+  }
+  static void set_rate_limit(const char* srv, const char* usr, double rate,
+                             double burst = 1) {
+    _servers.set_rate_limit(srv, usr, rate, burst);
+  }
+  // Share of the in-flight cap for each user of a server, or for one user.
+  // Default is 1.
+  static void set_weight(const char* srv, unsigned weight) {
+    _servers.set_weight(srv, std::string(), weight);
+  }
+  static void set_weight(const char* srv, const char* usr, unsigned weight) {
+    _servers.set_weight(srv, usr, weight);
+  }
+  // Where async callbacks run, and how many callback threads there are
+  // for completion::threads. Call it before creating the first instance.
+  static void set_completion(completion mode, size_t threads = 1) {
+    completion_queue().set_mode(mode, threads);
+  }
+  // Eventfd which is readable while callbacks wait for poll_completions()
+  static int completion_fd() { return (completion_queue().fd()); }
+  // Run up to max waiting callbacks on this thread, with completion::poll.
+  // Returns how many were run. Waiting requests don't count against the
+  // queue limits. When the last instance is destroyed, the callbacks which
+  // still wait run on its thread.
+  static size_t poll_completions(size_t max = SIZE_MAX) {
+    return (completion_queue().poll(max));
+  }
+  static CompletionQueue::Stats completion_stats() {
+    return (completion_queue().stats());
+  }
+  // Journal async requests in dir, so a crash or restart doesn't lose
+  // them: submit() returns once they are on disk, and they are sent at
+  // least once. Requests which weren't done are sent again now, with cb
+  // as their callback. Open it once, after creating an instance; it is
+  // closed with the last one. Throws std::runtime_error.
+  void open_spool(const std::string& dir, void (*cb)(Request&) = nullptr,
+                  size_t segment_size = size_t(64) << 20) {
+    if (!isRunning) throw std::runtime_error("No running instance!");
+    if (spool != nullptr) throw std::runtime_error("Spool is open!");
+    auto spool_ = std::make_unique<Spool>(dir, segment_size);
+    std::vector<RequestPtr> replayed_ = spool_->replay();
+    spool = spool_.release();
+    std::vector<Message> msgs_{};
+    msgs_.reserve(replayed_.size());
+    for (auto& r : replayed_) {
+      r->cb_ptr = cb;
+      msgs_.push_back(Message(std::move(r)));
+    }
+    _enqueue(msgs_.data(), msgs_.size(), overflow::block);
+  }
+  static Spool::Stats spool_stats() {
+    Spool* spool_ = spool;
+    return (spool_ != nullptr ? spool_->stats() : Spool::Stats{});
+  }
+  // Transfer metrics by server and user, merged from all threads
+  static MetricsSnapshot metrics_snapshot() { return (metrics().snapshot()); }
+  // The same in Prometheus text format
+  static std::string metrics_prometheus() {
+    return (metrics().snapshot().prometheus());
+  }
+  // PEM file of the CAs which sign the servers' certificates, like a
+  // test server's own certificate. Default is the system's bundle.
+  static void set_ca_file(const char* path) { _servers.set_ca_file(path); }
+  // Max parallel connections for each user of a server. Default is 1.
+  static void set_pool_size(size_t n) { _servers.set_pool_size(n); }
+  static void set_pool_size(const char* srv, size_t n) {
+    _servers.set_pool_size(srv, n);
   }
 
  private:
+  static constexpr size_t nLanes = 3;
+  // Requests of one connection key. Keys are served in the order of their
+  // virtual time, which grows by 1/weight for each started request.
+  struct KeyQueue {
+    std::deque<RequestPtr> reqs{};
+    double vtime{0};
+    unsigned weight{1};
+  };
+  // Sender thread with its own multi handle. Requests are queued by
+  // connection key, so a keep-alive connection stays on one worker.
+  struct Worker {
+    CURLM* multi{nullptr};
+    std::thread thread{};
+    // Lock-free list of submitted requests, the newest first
+    std::atomic<Request*> inbox{nullptr};
+    // True while the worker waits in curl_multi_poll
+    std::atomic<bool> sleeping{false};
+    // True while the worker drives transfers and can't look at its queues
+    std::atomic<bool> busy{false};
+    // True while the worker has no running transfers
+    std::atomic<bool> idle{true};
+    // True while the worker waits for a free slot of the in-flight cap
+    std::atomic<bool> starved{false};
+    // Set when a handle is returned to a pool which the worker waits for
+    std::atomic<bool> handoff{false};
+    size_t id{0};
+    // Guards lanes and credit
+    std::mutex mtx{};
+    struct Lane {
+      std::unordered_map<uint64_t, KeyQueue> queues{};
+      // Virtual time of the last started request
+      double vclock{0};
+    };
+    std::array<Lane, nLanes> lanes{};
+    // Starts of higher lanes while a lane waited
+    std::array<size_t, nLanes> credit{};
+    // Next token of a rate limited key, owned by the worker thread
+    std::chrono::steady_clock::time_point next_token{};
+    // Owned by the worker thread
+    std::unordered_map<CURL*, RequestPtr> running{};
+    // Finished requests for the completion queue, owned by the worker
+    std::vector<RequestPtr> completed{};
+    // Requests waiting for a retry, owned by the worker
+    TimerWheel retries{};
+
+    // Push the chain first..last, linked from the newest to the oldest
+    void push(Request* first, Request* last) noexcept {
+      Request* head_ = inbox.load(std::memory_order_relaxed);
+      do {
+        last->next = head_;
+      } while (!inbox.compare_exchange_weak(head_, first));
+    }
+    // Wake the worker only if it waits for work
+    void wake() noexcept {
+      if (sleeping.exchange(false)) curl_multi_wakeup(multi);
+    }
+    // Move submitted requests into the queues. Needs mtx.
+    void drain() {
+      Request* head_ = inbox.exchange(nullptr);
+      Request* prev_ = nullptr;
+      while (head_ != nullptr) {  // Restore submission order
+        Request* next_ = head_->next;
+        head_->next = prev_;
+        prev_ = head_;
+        head_ = next_;
+      }
+      while (prev_ != nullptr) {
+        RequestPtr req_(prev_);
+        prev_ = prev_->next;
+        req_->next = nullptr;
+        queue(*req_).reqs.push_back(std::move(req_));
+      }
+    }
+    // Queue of the key and lane of req. A new queue starts at the current
+    // virtual time, so an idle key can't save up a share. Needs mtx.
+    KeyQueue& queue(const Request& req) {
+      Lane& lane_ = lanes[static_cast<size_t>(req.lane)];
+      auto it_ = lane_.queues.find(req.key);
+      if (it_ != lane_.queues.end()) return (it_->second);
+      KeyQueue& queue_ = lane_.queues[req.key];
+      queue_.vtime = lane_.vclock;
+      queue_.weight = _servers.weight(req);
+      return (queue_);
+    }
+  };
+
   void run() {
     bool needRun = !isRunning.exchange(true);
     if (!needRun) return;
-    crawlerThread = std::thread(LibCurlWrapperEmail::_serve, this);
+    for (size_t i = 0; i < nWorkers; ++i) {
+      workers.emplace_back(new Worker);
+      workers.back()->multi = curl_multi_init();
+      workers.back()->id = i;
+    }
+    completion_queue().start();
+    for (size_t i = 0; i < workers.size(); ++i)
+      workers[i]->thread = std::thread(LibCurlWrapperEmail::_serve, this, i);
   }
   void stop() {
     bool needJoin = isRunning.exchange(false);
-    cV.notify_all();
     if (needJoin) {
-      if (crawlerThread.joinable()) crawlerThread.join();
+      for (auto& w : workers) curl_multi_wakeup(w->multi);
+      for (auto& w : workers)
+        if (w->thread.joinable()) w->thread.join();
+      for (auto& w : workers) _interrupt(*w);
+      completion_queue().stop();
+      delete spool.exchange(nullptr);
+      for (auto& w : workers) curl_multi_cleanup(w->multi);
+      workers.clear();
+      nQueued = 0;
+      nQueuedBytes = 0;
+      for (auto& n : laneWaiting) n = 0;
+      std::lock_guard<std::mutex> lck_(mtxSpace);
+      cvSpace.notify_all();
     }
   }
 
-  static void _serve(LibCurlWrapperEmail* this_) {
+  // Each worker drives its requests concurrently through its multi handle.
+  // A request waits in its queue while the keep-alive connection is busy.
+  // An idle worker steals a batch of requests for another connection.
+  static void _serve(LibCurlWrapperEmail* this_, size_t id) {
+    Worker& w = *workers[id];
     time_t next_clear_old_ = time(nullptr) + 3;
+    std::vector<RequestPtr> ready_{};
     while (isRunning) {
-      std::unique_lock<std::mutex> cv_lock_(cvMtx);
-      cV.wait_for(cv_lock_, std::chrono::seconds(1),
-                  [this_] { return (!globalRequests.empty() || !isRunning); });
+      this_->_take(w, ready_);
+      bool starved_ = w.starved;
+      if (ready_.empty() && w.running.empty()) this_->_steal(w, ready_);
+      this_->_start(w, ready_);
+
+      w.busy = true;
+      int still_running_ = 0;
+      curl_multi_perform(w.multi, &still_running_);
+      bool finished_ = this_->_finish(w);
+      completion_queue().post(w.completed);
+      w.idle = w.running.empty();
+      w.busy = false;
+
       // Clear old
-      if (next_clear_old_ <= time(nullptr)) {
+      if (id == 0 && next_clear_old_ <= time(nullptr)) {
         this_->_servers.clear_old();
         next_clear_old_ = time(nullptr) + 3;
       }
+      // Finished transfers release connections for queued requests.
+      // Idle workers look for work to steal more often.
+      // Rate limited keys and retries wake the worker when they are due.
+      if (!finished_) {
+        int timeout_ = w.idle && workers.size() > 1 ? 100 : 1000;
+        auto wake_ = w.retries.next();
+        if (w.next_token != std::chrono::steady_clock::time_point{})
+          wake_ = std::min(wake_, w.next_token);
+        if (wake_ != std::chrono::steady_clock::time_point::max()) {
+          auto wait_ = std::chrono::duration_cast<std::chrono::milliseconds>(
+                           wake_ - std::chrono::steady_clock::now())
+                           .count() +
+                       1;
+          timeout_ = static_cast<int>(
+              std::max<int64_t>(1, std::min<int64_t>(timeout_, wait_)));
+        }
+        w.sleeping = true;
+        // A slot of the in-flight cap or a handle may be free already
+        if (w.inbox.load() == nullptr && !(starved_ && !w.starved) &&
+            !w.handoff.exchange(false))
+          curl_multi_poll(w.multi, nullptr, 0, timeout_, nullptr);
+        w.sleeping = false;
+      }
+    }
+    // Interrupt transfers which are still running
+    for (auto& r : w.running) {
+      curl_multi_remove_handle(w.multi, r.first);
+      r.second->fail(CURLE_ABORTED_BY_CALLBACK, "Interrupted!");
+      r.second->spool_id = 0;  // Sent again after a restart
+      // Its SMTP transaction was cut off, so the handle isn't reused
+      _servers.discard(*r.second);
+      _release_slot();
+      _complete(w, r.second);
+    }
+    w.running.clear();
+    // Pending retries end with their last error
+    std::vector<RequestPtr> retries_{};
+    w.retries.clear(retries_);
+    for (auto& r : retries_) {
+      r->spool_id = 0;
+      _complete(w, r);
+    }
+    completion_queue().post(w.completed);
+  }
 
-      if (!isRunning) break;
-
-      if (globalRequests.empty()) continue;
-
-      mtxRequests.lock();
-      auto reqs = std::move(globalRequests);
-      globalRequests.clear();
-      mtxRequests.unlock();
-      if (!reqs.empty()) this_->_perform(reqs);
+  // Requests which are still queued on a stopped worker end like its
+  // interrupted transfers
+  static void _interrupt(Worker& w) {
+    std::lock_guard<std::mutex> lck_(w.mtx);
+    w.drain();
+    for (auto& lane : w.lanes) {
+      for (auto& q : lane.queues) {
+        for (auto& r : q.second.reqs) {
+          r->fail(CURLE_ABORTED_BY_CALLBACK, "Interrupted!");
+          r->spool_id = 0;  // Sent again after a restart
+          _complete(w, r);
+        }
+      }
+      lane.queues.clear();
     }
+    completion_queue().post(w.completed);
   }
 
-  // Thread for async performs
-  static inline std::thread crawlerThread{};
+  // Workers for async performs
+  static inline std::vector<std::unique_ptr<Worker>> workers{};
+  static inline size_t nWorkers{1};
+  // Async requests which are queued or running
+  static inline std::atomic<size_t> nQueued{0};
+  static inline std::atomic<size_t> nQueuedBytes{0};
+  // Async queue limits, 0 is unlimited
+  static inline std::atomic<size_t> maxQueued{0};
+  static inline std::atomic<size_t> maxQueuedBytes{0};
+  static inline std::atomic<overflow> overflowPolicy{overflow::block};
+  // Retries of transient failures, and their backoff in milliseconds
+  static inline std::atomic<unsigned> retryMax{0};
+  static inline std::atomic<int64_t> retryBase{1000};
+  static inline std::atomic<int64_t> retryCap{300000};
+  // Lower lanes are started once after this many starts of higher lanes
+  static inline std::atomic<size_t> starvationLimit{16};
+  static inline std::array<std::atomic<size_t>, nLanes> laneWaiting{};
+  // From submit to the start of the transfer
+  static inline std::array<LatencyHistogram, nLanes> laneWait{};
+  // Async transfers which are running, and their cap. 0 is unlimited.
+  static inline std::atomic<size_t> nInFlight{0};
+  static inline std::atomic<size_t> maxInFlight{0};
+  // Producers blocked by a full queue
+  static inline std::atomic<size_t> nBlocked{0};
+  static inline std::mutex mtxSpace{};
+  static inline std::condition_variable cvSpace{};
   // Local running flag
   static inline std::atomic<bool> isRunning{false};
   // How much instances of class created. For global init/cleanup.
   static inline std::atomic<size_t> nInstances{0};
+  static inline std::mutex mtxInstances{};
 
   // Each thread has its own structure
-  thread_local static inline std::vector<std::unique_ptr<Request>>
-      localRequests{};
-  // For async perform
-  static inline std::vector<std::unique_ptr<Request>> globalRequests{};
+  thread_local static inline std::vector<Message> localRequests{};
   // Each thread has its own structure
-  thread_local static inline std::unique_ptr<Request> _request{};
-  // For working with queue
-  static inline std::mutex mtxRequests{};
-  // For async queries
-  static inline std::mutex cvMtx{};
-  static inline std::condition_variable cV{};
+  thread_local static inline RequestPtr _request{};
 
   static inline KeepAliveServers _servers{};
+  // Journal of async requests, if open_spool() was called
+  static inline std::atomic<Spool*> spool{nullptr};
 
+  // Reserve queue space for msgs and pass them to the workers
+  bool _enqueue(Message* msgs, size_t count, overflow policy) {
+    size_t n_ = 0;
+    size_t bytes_ = 0;
+    Spool* spool_ = spool;
+    auto now_ = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < count; ++i) {
+      if (!msgs[i]._req) continue;
+      // A message which can't be built fails later, when it is sent
+      if (spool_ != nullptr && msgs[i]._req->spool_id == 0 &&
+          msgs[i]._req->is_data_valid()) {
+        try {
+          msgs[i]._req->freeze();
+        } catch ([[maybe_unused]] const std::exception& e) {
+        }
+      }
+      msgs[i]._req->submitted = now_;
+      msgs[i]._req->queued_bytes = msgs[i]._req->size_bytes();
+      bytes_ += msgs[i]._req->queued_bytes;
+      n_++;
+    }
+    if (n_ == 0) return (true);
+    if (!_reserve(n_, bytes_)) {
+      switch (policy) {
+        case overflow::block: {
+          std::unique_lock<std::mutex> lck_(mtxSpace);
+          nBlocked++;
+          cvSpace.wait(lck_, [n_, bytes_] {
+            return (!isRunning || _reserve(n_, bytes_));
+          });
+          nBlocked--;
+          if (!isRunning) return (false);
+          break;
+        }
+        case overflow::reject:
+          return (false);
+        case overflow::drop:
+          _fail(msgs, count, CURLE_SEND_ERROR, "Queue is full!");
+          return (false);
+      }
+    }
+    if (spool_ != nullptr && !_journal(*spool_, msgs, count)) {
+      _unreserve(n_, bytes_);
+      _fail(msgs, count, CURLE_WRITE_ERROR, "Can't write spool!");
+      return (false);
+    }
+    _submit(msgs, count);
+    return (true);
+  }
+  // Call back msgs with an error. A callback may resume a coroutine which
+  // owns its message, so msgs are emptied before the first callback.
+  static void _fail(Message* msgs, size_t count, CURLcode res,
+                    const char* what) {
+    std::vector<RequestPtr> reqs_{};
+    reqs_.reserve(count);
+    auto now_ = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < count; ++i) {
+      if (!msgs[i]._req) continue;
+      msgs[i]._req->fail(res, what);
+      msgs[i]._req->finished = now_;
+      reqs_.push_back(std::move(msgs[i]._req));
+    }
+    for (auto& r : reqs_) _callback(*r);
+  }
+  // Append serialized messages which aren't journaled yet to the spool,
+  // with one flush
+  static bool _journal(Spool& sp, Message* msgs, size_t count) {
+    std::vector<Request*> reqs_{};
+    reqs_.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+      Request* req_ = msgs[i]._req.get();
+      if (req_ != nullptr && req_->spool_id == 0 && !req_->spooled.empty())
+        reqs_.push_back(req_);
+    }
+    try {
+      return (sp.append(reqs_.data(), reqs_.size()));
+    } catch (const std::bad_alloc&) {
+      return (false);
+    }
+  }
+  // Queue request on the worker which owns its connection
+  // Each request is pushed with a single CAS for all requests of a worker
+  void _submit(Message* msgs, size_t count) const {
+    if (workers.empty()) return;
+    // Chains per worker: the newest and the oldest request
+    std::vector<std::pair<Request*, Request*>> chains_(workers.size());
+    for (size_t i = 0; i < count; ++i) {
+      RequestPtr& r = msgs[i]._req;
+      if (!r) continue;
+      laneWaiting[static_cast<size_t>(r->lane)]++;
+      r->make_key();
+      auto& chain_ = chains_[r->key % workers.size()];
+      r->next = chain_.first;
+      chain_.first = r.get();
+      if (chain_.second == nullptr) chain_.second = r.get();
+      r.release();
+    }
+    bool owner_busy_ = false;
+    for (size_t i = 0; i < workers.size(); ++i) {
+      if (chains_[i].first == nullptr) continue;
+      workers[i]->push(chains_[i].first, chains_[i].second);
+      workers[i]->wake();
+      owner_busy_ = owner_busy_ || workers[i]->busy;
+    }
+    // Let an idle worker steal them, if an owner is busy
+    if (!owner_busy_) return;
+    for (auto& other : workers) {
+      if (other->busy || !other->idle) continue;
+      other->wake();
+      break;
+    }
+  }
+  // Move requests with a free connection out of the worker queues
+  void _take(Worker& w, std::vector<RequestPtr>& ready) const {
+    std::lock_guard<std::mutex> lck_(w.mtx);
+    w.drain();
+    w.next_token = {};
+    w.starved = false;
+    if (!w.retries.empty()) {
+      std::vector<RequestPtr> due_{};
+      w.retries.advance(std::chrono::steady_clock::now(), due_);
+      for (auto& r : due_) {
+        r->error.clear();
+        r->result = CURLE_OK;
+        r->response_code = 0;
+        laneWaiting[static_cast<size_t>(r->lane)]++;
+        w.queue(*r).reqs.push_back(std::move(r));
+      }
+    }
+    // Min-heaps of keys by virtual time, for each lane. A key leaves its
+    // heap when its queue is empty or its connections are busy.
+    using Entry = std::pair<double, uint64_t>;
+    std::array<std::vector<Entry>, nLanes> heaps_{};
+    for (size_t l = 0; l < nLanes; ++l) {
+      heaps_[l].reserve(w.lanes[l].queues.size());
+      for (auto& q : w.lanes[l].queues)
+        heaps_[l].emplace_back(q.second.vtime, q.first);
+      std::make_heap(heaps_[l].begin(), heaps_[l].end(), std::greater<Entry>());
+    }
+    while (true) {
+      // The highest lane with work, unless a lower one waited too long
+      size_t l_ = nLanes;
+      for (size_t l = 0; l < nLanes; ++l) {
+        if (heaps_[l].empty()) continue;
+        if (l_ == nLanes) {
+          l_ = l;
+        } else if (w.credit[l] >= starvationLimit) {
+          l_ = l;
+          break;
+        }
+      }
+      if (l_ == nLanes) break;
+      auto& heap_ = heaps_[l_];
+      Worker::Lane& lane_ = w.lanes[l_];
+      std::pop_heap(heap_.begin(), heap_.end(), std::greater<Entry>());
+      KeyQueue& queue_ = lane_.queues[heap_.back().second];
+      heap_.pop_back();
+      Request& front_ = *queue_.reqs.front();
+      if (front_.is_data_valid()) {
+        if (!_take_slot()) {
+          w.starved = true;
+          break;
+        }
+        std::chrono::steady_clock::time_point next_{};
+        if (!_servers.try_init_and_lock(front_, &next_, w.id)) {
+          nInFlight--;
+          if (next_ != std::chrono::steady_clock::time_point{} &&
+              (w.next_token == std::chrono::steady_clock::time_point{} ||
+               next_ < w.next_token))
+            w.next_token = next_;
+          continue;
+        }
+        lane_.vclock = queue_.vtime;
+        queue_.vtime += 1.0 / queue_.weight;
+        w.credit[l_] = 0;
+        for (size_t l = l_ + 1; l < nLanes; ++l)
+          if (!heaps_[l].empty()) w.credit[l]++;
+      }
+      ready.push_back(std::move(queue_.reqs.front()));
+      queue_.reqs.pop_front();
+      if (!queue_.reqs.empty()) {
+        heap_.emplace_back(queue_.vtime, front_.key);
+        std::push_heap(heap_.begin(), heap_.end(), std::greater<Entry>());
+      }
+    }
+    for (auto& lane : w.lanes) {
+      for (auto it_ = lane.queues.begin(); it_ != lane.queues.end();) {
+        if (it_->second.reqs.empty())
+          it_ = lane.queues.erase(it_);
+        else
+          ++it_;
+      }
+    }
+  }
+  // Take the queue of a free connection from another worker
+  void _steal(Worker& w, std::vector<RequestPtr>& ready) const {
+    for (auto& other : workers) {
+      if (other.get() == &w || !other->mtx.try_lock()) continue;
+      other->drain();
+      KeyQueue batch_{};
+      for (auto& lane : other->lanes) {
+        auto& queues_ = lane.queues;
+        for (auto it_ = queues_.begin(); it_ != queues_.end(); ++it_) {
+          auto& front_ = *it_->second.reqs.front();
+          bool valid_ = front_.is_data_valid();
+          if (valid_ && !_take_slot()) break;
+          if (!valid_ || _servers.try_init_and_lock(front_)) {
+            batch_ = std::move(it_->second);
+            queues_.erase(it_);
+            break;
+          }
+          nInFlight--;
+        }
+        if (!batch_.reqs.empty()) break;
+      }
+      other->mtx.unlock();
+      if (batch_.reqs.empty()) continue;
+      ready.push_back(std::move(batch_.reqs.front()));
+      batch_.reqs.pop_front();
+      if (!batch_.reqs.empty()) {
+        std::lock_guard<std::mutex> lck_(w.mtx);
+        KeyQueue& queue_ = w.queue(*batch_.reqs.front());
+        for (auto& r : batch_.reqs) queue_.reqs.push_back(std::move(r));
+      }
+      return;
+    }
+  }
+  // Add ready requests to the multi handle
+  void _start(Worker& w, std::vector<RequestPtr>& ready) const {
+    auto now_ = std::chrono::steady_clock::now();
+    for (auto& r : ready) {
+      Request& req = *r;
+      req.started = now_;
+      auto lane_ = static_cast<size_t>(req.lane);
+      laneWaiting[lane_]--;
+      if (req.retries == 0) {
+        laneWait[lane_].record(now_ - req.submitted);
+        metrics().queue_wait(req, now_ - req.submitted);
+      }
+      if (req.curl == nullptr) {  // Invalid data
+        _complete(w, r);
+        continue;
+      }
+      if (!_prepare(req) ||
+          curl_multi_add_handle(w.multi, req.curl) != CURLM_OK) {
+        if (req.result == CURLE_OK)
+          req.fail(CURLE_FAILED_INIT, "Can't add handle!");
+        _servers.unlock(req);
+        _release_slot();
+        _complete(w, r);
+        continue;
+      }
+      w.running.emplace(req.curl, std::move(r));
+    }
+    ready.clear();
+  }
+  // Process finished transfers. Returns true if any transfer was finished.
+  bool _finish(Worker& w) const {
+    bool finished_ = false;
+    int msgs_left_ = 0;
+    while (CURLMsg* msg = curl_multi_info_read(w.multi, &msgs_left_)) {
+      if (msg->msg != CURLMSG_DONE) continue;
+      auto it_ = w.running.find(msg->easy_handle);
+      if (it_ == w.running.end()) continue;
+      CURLcode res_ = msg->data.result;
+      curl_multi_remove_handle(w.multi, msg->easy_handle);
+      it_->second->done(res_);
+      metrics().transfer(*it_->second);
+      finished_ = true;
+      if (_retry(w, it_->second)) {
+        w.running.erase(it_);
+        continue;
+      }
+      _servers.unlock(*it_->second);
+      _release_slot();
+      _complete(w, it_->second);
+      w.running.erase(it_);
+    }
+    return (finished_);
+  }
   //
-  void _perform(std::vector<std::unique_ptr<Request>>& req) const noexcept {
-    if (req.empty()) return;
-    for (auto& r : req) _perform_once(*r);
+  void _perform(Message* msgs, size_t count) const noexcept {
+    for (size_t i = 0; i < count; ++i)
+      if (msgs[i]._req) _perform_once(*msgs[i]._req);
+  }
+  template <class Field>
+  LibCurlWrapperEmail& _set(Field&& field) {
+    if (!localRequests.empty())
+      localRequests.back() << std::forward<Field>(field);
+    return (*this);
   }
   //
   void _perform_once(Request& req) const noexcept {
     if (req.is_data_valid()) {
+      req.make_key();
+      auto locking_ = std::chrono::steady_clock::now();
       _servers.init_and_lock(req);
-      try {
-        req.set_options();
-        req.build_headers();
-        req.build_body();
+      metrics().lock_wait(req, std::chrono::steady_clock::now() - locking_);
+      if (_prepare(req)) {
         req.perform();
-      } catch ([[maybe_unused]] const std::exception& e) {
+        metrics().transfer(req);
       }
       _servers.unlock(req);
     }
+    _callback(req);
+  }
+  // Set options, headers and body. Returns false on error.
+  static bool _prepare(Request& req) noexcept {
+    try {
+      req.set_options();
+      req.build_message();
+    } catch (const std::exception& e) {
+      // A file which can't be read, or a signature which can't be made
+      req.fail(CURLE_READ_ERROR, e.what());
+      return (false);
+    }
+    return (true);
+  }
+  // Schedule a retry of a transient failure with exponential backoff and
+  // jitter. The connection is released while the request waits.
+  static bool _retry(Worker& w, RequestPtr& req) {
+    Request& r = *req;
+    if (r.retries >= retryMax || !r.transient() || !isRunning) return (false);
+    // A connection which failed without a reply may be dead, and with 421
+    // the server closes it. It may still be in the connection cache of
+    // the worker, so the retry connects again.
+    r.fresh_connect = r.response_code < 400 || r.response_code == 421;
+    if (r.fresh_connect)
+      _servers.discard(r);
+    else
+      _servers.unlock(r);
+    _release_slot();
+    int64_t delay_ = retryBase.load() << std::min(r.retries, 20U);
+    delay_ = std::min<int64_t>(delay_, retryCap);
+    delay_ = delay_ / 2 + static_cast<int64_t>(fast_random() %
+                                               static_cast<uint64_t>(delay_ / 2 + 1));
+    r.retries++;
+    w.retries.add(std::move(req), std::chrono::steady_clock::now() +
+                                      std::chrono::milliseconds(delay_));
+    return (true);
+  }
+  // Reserve a transfer of the in-flight cap
+  static bool _take_slot() noexcept {
+    size_t n_ = nInFlight.fetch_add(1) + 1;
+    if (maxInFlight == 0 || n_ <= maxInFlight) return (true);
+    nInFlight--;
+    return (false);
+  }
+  // Wake the workers whose queued requests wait for a returned handle
+  static void _wake_parked(uint64_t parked) noexcept {
+    if (!isRunning) return;
+    for (auto& w : workers) {
+      if ((parked >> (w->id % 64) & 1) == 0) continue;
+      w->handoff = true;
+      w->wake();
+    }
+  }
+  // End a transfer and wake workers which wait for a slot
+  static void _release_slot() noexcept {
+    nInFlight--;
+    if (maxInFlight == 0) return;
+    for (auto& w : workers)
+      if (w->starved.exchange(false)) w->wake();
+  }
+  // Count requests against the async queue limits, only if they fit, so
+  // concurrent submitters don't see each other's rejected batches
+  static bool _reserve(size_t n, size_t bytes) noexcept {
+    // A batch which doesn't fit into an empty queue is accepted anyway
+    size_t queued_ = nQueued.load();
+    do {
+      if (queued_ != 0 && maxQueued != 0 && queued_ + n > maxQueued)
+        return (false);
+    } while (!nQueued.compare_exchange_weak(queued_, queued_ + n));
+    bool empty_ = queued_ == 0;
+    size_t queued_bytes_ = nQueuedBytes.load();
+    do {
+      if (!empty_ && maxQueuedBytes != 0 &&
+          queued_bytes_ + bytes > maxQueuedBytes) {
+        // Called with mtxSpace by blocked submitters, so it doesn't notify.
+        // The queue isn't empty, and its completions notify.
+        nQueued -= n;
+        return (false);
+      }
+    } while (!nQueuedBytes.compare_exchange_weak(queued_bytes_,
+                                                 queued_bytes_ + bytes));
+    return (true);
+  }
+  // Give back queue space and wake blocked submitters
+  static void _unreserve(size_t n, size_t bytes) noexcept {
+    nQueued -= n;
+    nQueuedBytes -= bytes;
+    if (nBlocked != 0) {
+      std::lock_guard<std::mutex> lck_(mtxSpace);
+      cvSpace.notify_all();
+    }
+  }
+  // Release the queue space of a finished async request and call it back,
+  // here or from the completion queue
+  static void _complete(Worker& w, RequestPtr& req) noexcept {
+    req->finished = std::chrono::steady_clock::now();
+    Spool* spool_ = spool;
+    if (req->spool_id != 0 && spool_ != nullptr) {
+      try {
+        spool_->complete(req->spool_id);
+      } catch (const std::bad_alloc&) {
+      }
+    }
+    _unreserve(1, req->queued_bytes);
+    if (completion_queue().mode() == completion::worker) {
+      _callback(*req);
+      return;
+    }
+    try {
+      w.completed.push_back(std::move(req));
+    } catch (const std::bad_alloc&) {
+      _callback(*req);
+    }
+  }
+  static void _callback(Request& req) noexcept {
     try {
       req.callback();
     } catch ([[maybe_unused]] const std::exception& e) {
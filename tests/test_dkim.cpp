@@ -0,0 +1,266 @@
+// DKIM test vectors: body hashes from RFC 6376 and RFC 8463, and the
+// Ed25519 example of RFC 8463. A signature is checked with an independent
+// verifier, which must accept the RFC's own signature first.
+#include <openssl/bio.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+
+#include <fstream>
+#include <iostream>
+
+#include "libcurlwrappersmtp.hpp"
+
+using namespace libcurlwrappersmtp;
+
+namespace {
+
+int failures_ = 0;
+
+void check(bool ok, const std::string& what) {
+  if (ok) return;
+  std::cerr << "FAILED: " << what << std::endl;
+  failures_++;
+}
+
+// RFC 8463 appendix A
+const char* rfc8463_private_ = "nWGxne/9WmC6hEr0kuwsxERJxWl7MmkZcDusAxyuf2A=";
+const char* rfc8463_public_ = "11qYAYKxCrfVS/7TyWQHOg7hcvPapiMlrwIaaPcHURo=";
+// Any other key
+const char* other_private_ = "AQEBAQEBAQEBAQEBAQEBAQEBAQEBAQEBAQEBAQEBAQE=";
+const char* rfc8463_signature_ =
+    "DKIM-Signature: v=1; a=ed25519-sha256; c=relaxed/relaxed;\r\n"
+    " d=football.example.com; i=@football.example.com;\r\n"
+    " q=dns/txt; s=brisbane; t=1528637909; h=from : to :\r\n"
+    " subject : date : message-id : from : subject : date;\r\n"
+    " bh=2jUSOH9NhtVGCQWNr9BrIAPreKQjO6Sn7XIkfJVOzv8=;\r\n"
+    " b=/gCrinpcQOoIfuHNQIbq4pgh9kyIK3AQUdt9OdqQehSwhEIug4D11Bus\r\n"
+    " Fa3bT3FY5OsU7ZbnKELq+eXdp1Q1Dw==\r\n";
+const char* rfc8463_message_ =
+    "From: Joe SixPack <joe@football.example.com>\r\n"
+    "To: Suzie Q <suzie@shopping.example.net>\r\n"
+    "Subject: Is dinner ready?\r\n"
+    "Date: Fri, 11 Jul 2003 21:00:37 -0700 (PDT)\r\n"
+    "Message-ID: <20030712040037.46341.5F8J@football.example.com>\r\n"
+    "\r\n"
+    "Hi.\r\n"
+    "\r\n"
+    "We lost the game.  Are you hungry yet?\r\n"
+    "\r\n"
+    "Joe.\r\n";
+
+std::string base64_decode(const std::string& in) {
+  std::string out_(in.size() / 4 * 3, '\0');
+  int size_ = EVP_DecodeBlock(reinterpret_cast<unsigned char*>(&out_[0]),
+                              reinterpret_cast<const unsigned char*>(in.data()),
+                              static_cast<int>(in.size()));
+  out_.resize(size_ < 0 ? 0 : static_cast<size_t>(size_));
+  size_t pad_ = in.size() - in.find_last_not_of('=') - 1;
+  out_.resize(out_.size() - std::min(pad_, out_.size()));
+  return (out_);
+}
+
+std::string sha256_base64(const std::string& data) {
+  unsigned char hash_[EVP_MAX_MD_SIZE];
+  unsigned int size_ = 0;
+  EVP_Digest(data.data(), data.size(), hash_, &size_, EVP_sha256(), nullptr);
+  std::string out_;
+  base64_encode(reinterpret_cast<const char*>(hash_), size_, out_);
+  return (out_);
+}
+
+// Relaxed header canonicalization of RFC 6376 3.4.2, without the CRLF
+std::string relaxed(const std::string& field) {
+  size_t colon_ = field.find(':');
+  std::string out_;
+  for (char c : field.substr(0, colon_))
+    if (c != ' ' && c != '\t')
+      out_.push_back(static_cast<char>(tolower(static_cast<unsigned char>(c))));
+  out_.push_back(':');
+  std::string value_;
+  for (char c : field.substr(colon_ + 1)) {
+    if (c == '\r' || c == '\n') continue;
+    if (c == '\t') c = ' ';
+    if (c == ' ' && (value_.empty() || value_.back() == ' ')) continue;
+    value_.push_back(c);
+  }
+  while (!value_.empty() && value_.back() == ' ') value_.pop_back();
+  return (out_ + value_);
+}
+
+// Unfolded header fields of a message
+std::vector<std::string> header_fields(const std::string& message) {
+  std::vector<std::string> fields_;
+  size_t pos_ = 0;
+  while (true) {
+    size_t end_ = message.find("\r\n", pos_);
+    if (end_ == std::string::npos || end_ == pos_) break;
+    std::string line_ = message.substr(pos_, end_ + 2 - pos_);
+    if ((line_[0] == ' ' || line_[0] == '\t') && !fields_.empty())
+      fields_.back().append(line_);
+    else
+      fields_.push_back(line_);
+    pos_ = end_ + 2;
+  }
+  return (fields_);
+}
+
+// Value of a tag of a canonicalized DKIM-Signature
+std::string tag(const std::string& sig, const std::string& name) {
+  size_t pos_ = sig.find(':') + 1;
+  while (pos_ < sig.size()) {
+    size_t end_ = sig.find(';', pos_);
+    if (end_ == std::string::npos) end_ = sig.size();
+    std::string item_ = sig.substr(pos_, end_ - pos_);
+    item_.erase(0, item_.find_first_not_of(' '));
+    if (item_.compare(0, name.size() + 1, name + "=") == 0) {
+      std::string value_ = item_.substr(name.size() + 1);
+      value_.erase(std::remove(value_.begin(), value_.end(), ' '),
+                   value_.end());
+      return (value_);
+    }
+    pos_ = end_ + 1;
+  }
+  return (std::string());
+}
+
+// Verifies the first DKIM-Signature of an ed25519-sha256 signed message
+bool verify(const std::string& message, const std::string& public_key) {
+  std::vector<std::string> fields_ = header_fields(message);
+  if (fields_.empty()) return (false);
+  std::string sig_ = relaxed(fields_[0]);
+  std::string body_ = message.substr(message.find("\r\n\r\n") + 4);
+  if (tag(sig_, "a") != "ed25519-sha256" ||
+      tag(sig_, "bh") != dkim_hash_body(body_))
+    return (false);
+  // Signed fields, each instance from the bottom up
+  std::string data_;
+  std::vector<bool> used_(fields_.size(), false);
+  std::string names_ = tag(sig_, "h") + ":";
+  for (size_t pos_ = 0, end_; (end_ = names_.find(':', pos_)) !=
+                              std::string::npos;
+       pos_ = end_ + 1) {
+    std::string name_ = names_.substr(pos_, end_ - pos_);
+    for (size_t i = fields_.size(); i-- > 1;) {
+      std::string field_ = relaxed(fields_[i]);
+      if (used_[i] || field_.compare(0, name_.size() + 1, name_ + ":") != 0)
+        continue;
+      used_[i] = true;
+      data_.append(field_);
+      data_.append("\r\n");
+      break;
+    }
+  }
+  // The signature itself, with an empty b=
+  size_t b_ = sig_.rfind("b=");
+  data_.append(sig_.substr(0, b_ + 2));
+  unsigned char hash_[EVP_MAX_MD_SIZE];
+  unsigned int hash_size_ = 0;
+  EVP_Digest(data_.data(), data_.size(), hash_, &hash_size_, EVP_sha256(),
+             nullptr);
+  std::string raw_ = base64_decode(public_key);
+  std::string b_value_ = base64_decode(tag(sig_, "b"));
+  EVP_PKEY* key_ = EVP_PKEY_new_raw_public_key(
+      EVP_PKEY_ED25519, nullptr,
+      reinterpret_cast<const unsigned char*>(raw_.data()), raw_.size());
+  EVP_MD_CTX* ctx_ = EVP_MD_CTX_new();
+  bool ok_ =
+      key_ != nullptr && ctx_ != nullptr &&
+      EVP_DigestVerifyInit(ctx_, nullptr, nullptr, nullptr, key_) == 1 &&
+      EVP_DigestVerify(
+          ctx_, reinterpret_cast<const unsigned char*>(b_value_.data()),
+          b_value_.size(), hash_, hash_size_) == 1;
+  EVP_MD_CTX_free(ctx_);
+  EVP_PKEY_free(key_);
+  return (ok_);
+}
+
+// PEM of a raw Ed25519 private key
+std::string private_pem(const std::string& private_key) {
+  std::string raw_ = base64_decode(private_key);
+  EVP_PKEY* key_ = EVP_PKEY_new_raw_private_key(
+      EVP_PKEY_ED25519, nullptr,
+      reinterpret_cast<const unsigned char*>(raw_.data()), raw_.size());
+  BIO* bio_ = BIO_new(BIO_s_mem());
+  std::string pem_;
+  if (key_ != nullptr && bio_ != nullptr &&
+      PEM_write_bio_PrivateKey(bio_, key_, nullptr, nullptr, 0, nullptr,
+                               nullptr) == 1) {
+    char* data_ = nullptr;
+    long size_ = BIO_get_mem_data(bio_, &data_);
+    pem_.assign(data_, static_cast<size_t>(size_));
+  }
+  BIO_free(bio_);
+  EVP_PKEY_free(key_);
+  return (pem_);
+}
+
+}  // namespace
+
+int main() {
+  std::string message_ = rfc8463_message_;
+  std::string body_ = message_.substr(message_.find("\r\n\r\n") + 4);
+
+  // Relaxed body hashes
+  check(dkim_hash_body(body_) ==
+            "2jUSOH9NhtVGCQWNr9BrIAPreKQjO6Sn7XIkfJVOzv8=",
+        "RFC 8463 body hash");
+  check(dkim_hash_body(" C \r\nD \t E\r\n\r\n\r\n") ==
+            sha256_base64(" C\r\nD E\r\n"),
+        "RFC 6376 3.4.5 relaxed body");
+  check(dkim_hash_body("") == "47DEQpj8HBSa+/TImW+5JCeuQeRkm5NMpJWZG3hSuFU=",
+        "Empty body hash");
+  DkimBodyHash pieces_{};
+  for (char c : body_) pieces_.update(std::string_view(&c, 1));
+  check(pieces_.finish() == dkim_hash_body(body_), "Body hash in pieces");
+
+  // The verifier accepts the RFC's signature, and nothing else
+  check(verify(rfc8463_signature_ + message_, rfc8463_public_),
+        "RFC 8463 signature verifies");
+  std::string changed_ = rfc8463_signature_ + message_;
+  changed_.replace(changed_.find("dinner"), 6, "lunch!");
+  check(!verify(changed_, rfc8463_public_), "Changed message fails");
+
+  // A signature with the RFC's key verifies with its public key
+  std::string pem_ = private_pem(rfc8463_private_);
+  check(!pem_.empty(), "RFC 8463 private key");
+  if (!pem_.empty()) {
+    DkimSigner signer_("football.example.com", "brisbane", pem_);
+    std::string signed_ = signer_.sign(message_, 1528637909) + message_;
+    check(verify(signed_, rfc8463_public_), "Signature verifies");
+    check(relaxed(header_fields(signed_)[0]).find(
+              "bh=2jUSOH9NhtVGCQWNr9BrIAPreKQjO6Sn7XIkfJVOzv8=") !=
+              std::string::npos,
+          "Signature has the RFC 8463 body hash");
+
+    // Another key for the same selector replaces the cached signer
+    std::string other_ = private_pem(other_private_);
+    auto cached_ = dkim_signer("football.example.com", "brisbane", pem_);
+    check(cached_ == dkim_signer("football.example.com", "brisbane", pem_),
+          "Signer is cached");
+    auto rotated_ = dkim_signer("football.example.com", "brisbane", other_);
+    check(!verify(rotated_->sign(message_, 1528637909) + message_,
+                  rfc8463_public_),
+          "Signer with another key");
+
+    // So does a changed key file
+    char path_[] = "/tmp/test_dkim_XXXXXX";
+    int fd_ = mkstemp(path_);
+    check(fd_ >= 0, "Key file");
+    if (fd_ >= 0) {
+      close(fd_);
+      std::ofstream(path_, std::ios::trunc) << other_;
+      auto old_ = dkim_signer("football.example.com", "brisbane", path_);
+      std::ofstream(path_, std::ios::trunc) << pem_;
+      // File times may be coarser than two writes
+      struct timespec times_[2] = {{0, UTIME_OMIT}, {1000000000, 0}};
+      utimensat(AT_FDCWD, path_, times_, 0);
+      auto new_ = dkim_signer("football.example.com", "brisbane", path_);
+      check(old_ != new_ &&
+                verify(new_->sign(message_, 1528637909) + message_,
+                       rfc8463_public_),
+            "Signer of a changed key file");
+      unlink(path_);
+    }
+  }
+  return (failures_ == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -0,0 +1,128 @@
+// Reopens copies of a spool while it is in use. A copy must replay the
+// requests which aren't done, and only those.
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+
+#include "libcurlwrappersmtp.hpp"
+#include "smtp_sink.hpp"
+
+using namespace libcurlwrappersmtp;
+
+namespace {
+
+std::atomic<size_t> done_{0};
+std::atomic<size_t> errors_{0};
+int failures_ = 0;
+
+void check(bool ok, const std::string& what) {
+  if (ok) return;
+  std::cerr << "FAILED: " << what << std::endl;
+  failures_++;
+}
+
+void callback(Request& req) {
+  if (!req.error.empty() && errors_++ == 0)
+    std::cerr << "Error: " << req.error << std::endl;
+  done_++;
+}
+
+void send(LibCurlWrapperEmail& emailer, const std::string& url,
+          const char* usr, const std::string& body) {
+  emailer << server(url.c_str()) << user(usr, "secret")
+          << from("Test", "<test@example.org>")
+          << to("Rcpt", "<rcpt@example.org>") << subject("Spool")
+          << mimetext(body) << &callback << directive::asyncperform;
+}
+
+// Requests which a copy of the spool in dir would send again
+size_t replayed(const std::string& dir, const std::string& copy) {
+  std::filesystem::remove_all(copy);
+  std::filesystem::copy(dir, copy);
+  Spool spool_(copy, 4096);
+  return (spool_.replay().size());
+}
+
+// Tombstones are flushed and done segments deleted in the background, so
+// the state is polled until it is reached or a deadline passes
+template <class Reached>
+bool wait_until(Reached reached) {
+  auto deadline_ = std::chrono::steady_clock::now() + std::chrono::seconds(60);
+  while (!reached()) {
+    if (std::chrono::steady_clock::now() > deadline_) return (false);
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  }
+  return (true);
+}
+
+}  // namespace
+
+int main() {
+  char dir_[] = "/tmp/test_spool_XXXXXX";
+  if (mkdtemp(dir_) == nullptr) {
+    std::cerr << "Can't create " << dir_ << std::endl;
+    return (EXIT_FAILURE);
+  }
+  std::string spool_dir_ = std::string(dir_) + "/spool";
+  std::string copy_dir_ = std::string(dir_) + "/copy";
+
+  smtp_sink::SmtpSink fast_(smtp_sink::SmtpSink::Options{});
+  // The slow sink holds its replies to MAIL until it is released
+  smtp_sink::SmtpSink::Options slow_options_{};
+  slow_options_.delay_at_mail = true;
+  smtp_sink::SmtpSink slow_(slow_options_);
+  slow_.hold();
+  std::string ca_file_ = std::string(dir_) + "/ca.pem";
+  {
+    std::ofstream ca_(ca_file_);
+    ca_ << fast_.certificate() << slow_.certificate();
+  }
+  LibCurlWrapperEmail::set_ca_file(ca_file_.c_str());
+  std::string fast_url_ = "smtp://localhost:" + std::to_string(fast_.port());
+  std::string slow_url_ = "smtp://localhost:" + std::to_string(slow_.port());
+  std::string body_(300, 'x');
+  {
+    LibCurlWrapperEmail emailer_{};
+    emailer_.open_spool(spool_dir_, nullptr, 4096);
+    // The slow requests stay live in the first segment, the tombstones of
+    // the fast ones fill the later segments
+    for (const char* usr : {"slow1", "slow2", "slow3"})
+      send(emailer_, slow_url_, usr, body_);
+    for (size_t i = 0; i < 60; ++i) send(emailer_, fast_url_, "fast", body_);
+    bool ok_ = wait_until([] {
+      return (done_ == 60 && LibCurlWrapperEmail::spool_stats().live == 3);
+    });
+    check(ok_, "3 live requests, not " +
+                   std::to_string(LibCurlWrapperEmail::spool_stats().live));
+    // Until the tombstones are on disk a copy replays more
+    size_t n_ = 0;
+    ok_ = wait_until([&] {
+      n_ = replayed(spool_dir_, copy_dir_);
+      return (n_ == 3);
+    });
+    check(ok_, "3 requests replayed, not " + std::to_string(n_));
+    check(done_ == 60, "The slow requests are still running");
+
+    // When all are done, the segments are deleted
+    slow_.release();
+    ok_ = wait_until([] {
+      auto stats_ = LibCurlWrapperEmail::spool_stats();
+      return (done_ == 63 && stats_.live == 0 && stats_.segments <= 1);
+    });
+    auto stats_ = LibCurlWrapperEmail::spool_stats();
+    check(ok_, "Only the write segment is left, not " +
+                   std::to_string(stats_.segments) + " with " +
+                   std::to_string(stats_.live) + " live requests");
+    ok_ = wait_until([&] {
+      n_ = replayed(spool_dir_, copy_dir_);
+      return (n_ == 0);
+    });
+    check(ok_, "No requests replayed, not " + std::to_string(n_));
+  }
+  check(errors_ == 0, "No errors");
+  std::filesystem::remove_all(dir_);
+  return (failures_ == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}